@@ -0,0 +1,422 @@
+#include "2310bench.h"
+
+// Send error message to stderr and exit code, exitStatus gives the
+// exit code
+void show_message(int exitStatus) {
+    const char *messages[] = {"",
+            "Usage: 2310bench depots chain|star|mesh messages "
+            "[batch [depot]]\n",
+            "Invalid number\n",
+            "Invalid topology\n",
+            "Depot failed to start\n",
+            "Depots failed to connect\n"};
+    fprintf(stderr, messages[exitStatus]);
+    exit(exitStatus);
+}
+
+// main function initially run on startup. argc is number of arguments,
+// argv is an array of those arguments
+int main(int argc, char *argv[]) {
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    check_args(argc, argv, &bench);
+    signal(SIGPIPE, SIG_IGN);
+
+    bench.depots = calloc(bench.numDepots, sizeof(Depot));
+    for (int i = 0; i < bench.numDepots; i++) {
+        start_depot(&bench, i);
+    }
+    for (int i = 0; i < bench.numDepots; i++) {
+        connect_to_depot(&bench, i);
+    }
+    wire_depots(&bench);
+    wait_for_wiring(&bench);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_workload(&bench);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(&bench, elapsed(&start, &end));
+    stop_depots(&bench);
+    return 0;
+}
+
+// Check the command line arguments and fill in the benchmark settings
+// argc is the number of arguments, argv is an array of those arguments
+// and bench is where the settings go
+void check_args(int argc, char *argv[], Bench *bench) {
+    if (argc < 4 || argc > 6) {
+        show_message(1);
+    }
+    bench->numDepots = read_number(argv[1]);
+    bench->messages = read_number(argv[3]);
+    bench->batch = argc > 4 ? read_number(argv[4]) : DEFAULT_BATCH;
+    bench->depotPath = argc > 5 ? argv[5] : DEFAULT_DEPOT;
+    if (bench->numDepots < 1 || bench->messages < 1 || bench->batch < 1) {
+        show_message(2);
+    }
+    if (!strcmp(argv[2], "chain")) {
+        bench->topology = CHAIN;
+    } else if (!strcmp(argv[2], "star")) {
+        bench->topology = STAR;
+    } else if (!strcmp(argv[2], "mesh")) {
+        bench->topology = MESH;
+    } else {
+        show_message(3);
+    }
+}
+
+// Read a whole non-negative number from a string. Return -1 if the string
+// isn't one. input is the string we are reading
+int read_number(char *input) {
+    char *end;
+    long value = strtol(input, &end, 10);
+    if (*input == '\0' || *end != '\0' || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    return value;
+}
+
+// Return the number of seconds from start to end
+double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) +
+            (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Start a depot called D<index> and read the port it is listening on
+// bench is the benchmark and index is the depot to start
+void start_depot(Bench *bench, int index) {
+    Depot *depot = &bench->depots[index];
+    int fds[2];
+    if (pipe(fds)) {
+        show_message(4);
+    }
+    depot->pid = fork();
+    if (depot->pid == 0) {
+        char name[32];
+        sprintf(name, "D%d", index);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(bench->depotPath, bench->depotPath, name, (char *)NULL);
+        _exit(4);
+    }
+    close(fds[1]);
+    depot->output = fds[0];
+    // the first line the depot prints is its port
+    char line[32];
+    size_t length = 0;
+    while (length < sizeof(line) - 1 &&
+            read(depot->output, line + length, 1) == 1 &&
+            line[length] != '\n') {
+        length++;
+    }
+    line[length] = '\0';
+    depot->port = read_number(line);
+    if (depot->pid < 0 || depot->port <= 0) {
+        show_message(4);
+    }
+}
+
+// Connect to a depot as a neighbour called bench, so the depot can
+// Transfer goods back to us. bench is the benchmark and index is the depot
+void connect_to_depot(Bench *bench, int index) {
+    Depot *depot = &bench->depots[index];
+    struct addrinfo *ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    sprintf(port, "%d", depot->port);
+    if (getaddrinfo("127.0.0.1", port, &hints, &ai)) {
+        show_message(4);
+    }
+    depot->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(depot->fd, ai->ai_addr, ai->ai_addrlen)) {
+        show_message(4);
+    }
+    freeaddrinfo(ai);
+    // port 1 can never belong to a depot, so it won't clash with one
+    send_line(depot, "IM:1:bench\n");
+}
+
+// Send a formatted message to a depot, waiting until all of it is sent
+// depot is where the message is going and format is a printf style format
+// string followed by its arguments
+void send_line(Depot *depot, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    for (int sent = 0; sent < length; ) {
+        ssize_t count = write(depot->fd, line + sent, length - sent);
+        if (count < 0) {
+            return;
+        }
+        sent += count;
+    }
+}
+
+// Check if two depots are joined in the chosen topology. Return true if so
+// bench is the benchmark and first and second are the depots
+bool linked(Bench *bench, int first, int second) {
+    if (first == second) {
+        return false;
+    }
+    switch (bench->topology) {
+        case CHAIN:
+            return abs(first - second) == 1;
+        case STAR:
+            return first == 0 || second == 0;
+        default:
+            return true;
+    }
+}
+
+// Tell the depots to connect to each other in the chosen topology, and
+// pick which neighbour each depot transfers goods to
+// bench is the benchmark
+void wire_depots(Bench *bench) {
+    for (int i = 0; i < bench->numDepots; i++) {
+        Depot *depot = &bench->depots[i];
+        // every depot also has us as a neighbour
+        depot->expectedNeighbours = 1;
+        depot->target = -1;
+        for (int j = 0; j < bench->numDepots; j++) {
+            if (!linked(bench, i, j)) {
+                continue;
+            }
+            depot->expectedNeighbours++;
+            if (depot->target == -1 || j == (i + 1) % bench->numDepots) {
+                depot->target = j;
+            }
+            if (i < j) {
+                send_line(depot, "Connect:%d\n", bench->depots[j].port);
+            }
+        }
+    }
+}
+
+// Ask a depot for its report with SIGHUP and count its neighbours
+// Return the number of neighbours, or -1 if the report couldn't be read
+// depot is the depot we are asking
+int count_neighbours(Depot *depot) {
+    kill(depot->pid, SIGHUP);
+    size_t allocated = 4096, length = 0;
+    char *output = malloc(allocated);
+    struct pollfd pfd = {depot->output, POLLIN, 0};
+    // the report is finished once the depot has been quiet for a while
+    while (poll(&pfd, 1, REPORT_QUIET) > 0) {
+        if (length + 1024 >= allocated) {
+            allocated *= 2;
+            output = realloc(output, allocated);
+        }
+        ssize_t count = read(depot->output, output + length, 1024);
+        if (count <= 0) {
+            break;
+        }
+        length += count;
+    }
+    output[length] = '\0';
+    int neighbours = -1;
+    for (char *section = strstr(output, "Neighbours:\n"); section != NULL;
+            section = strstr(section + 1, "Neighbours:\n")) {
+        neighbours = 0;
+        for (char *c = section + strlen("Neighbours:\n"); *c != '\0'; c++) {
+            if (*c == '\n') {
+                neighbours++;
+            }
+        }
+    }
+    free(output);
+    return neighbours;
+}
+
+// Wait until every depot has all of its neighbours connected
+// bench is the benchmark
+void wait_for_wiring(Bench *bench) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < bench->numDepots; i++) {
+        while (count_neighbours(&bench->depots[i]) !=
+                bench->depots[i].expectedNeighbours) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (elapsed(&start, &now) * 1000 > WIRE_TIMEOUT) {
+                show_message(5);
+            }
+        }
+    }
+}
+
+// Send a depot its next batch of messages, ending with a Transfer back to
+// us which tells us when the depot has handled the whole batch
+// bench is the benchmark and index is the depot
+void send_batch(Bench *bench, int index) {
+    Depot *depot = &bench->depots[index];
+    long perDepot = bench->messages / bench->numDepots +
+            (index < bench->messages % bench->numDepots);
+    long key = depot->batches++;
+    size_t allocated = (bench->batch + 1) * 64, length = 0;
+    char *batch = malloc(allocated);
+    for (int i = 0; i < bench->batch && depot->sent < perDepot; i++) {
+        int good = depot->sent++ % NUM_GOODS;
+        char *line = batch + length;
+        switch (i % 5) {
+            case 0:
+                length += sprintf(line, "Deliver:1:g%d\n", good);
+                break;
+            case 1:
+                length += sprintf(line, "Withdraw:1:g%d\n", good);
+                break;
+            case 2:
+                if (depot->target != -1) {
+                    length += sprintf(line, "Transfer:1:g%d:D%d\n", good,
+                            depot->target);
+                } else {
+                    length += sprintf(line, "Deliver:1:g%d\n", good);
+                }
+                break;
+            case 3:
+                length += sprintf(line, "Defer:%ld:Deliver:1:g%d\n", key,
+                        good);
+                break;
+            default:
+                length += sprintf(line, "Execute:%ld\n", key);
+        }
+    }
+    length += sprintf(batch + length, "Transfer:1:probe:bench\n");
+    clock_gettime(CLOCK_MONOTONIC, &depot->batchStart);
+    for (size_t sent = 0; sent < length; ) {
+        ssize_t count = write(depot->fd, batch + sent, length - sent);
+        if (count < 0) {
+            break;
+        }
+        sent += count;
+    }
+    depot->waiting = true;
+    free(batch);
+}
+
+// Read what a depot has sent us. Each Deliver is the echo of a batch, so
+// record how long the batch took and send the next one
+// bench is the benchmark and index is the depot
+void read_echoes(Bench *bench, int index) {
+    Depot *depot = &bench->depots[index];
+    ssize_t count = read(depot->fd, depot->readBuffer + depot->readLength,
+            sizeof(depot->readBuffer) - depot->readLength);
+    if (count <= 0) {
+        depot->waiting = false;
+        return;
+    }
+    depot->readLength += count;
+    char *line = depot->readBuffer;
+    char *newline;
+    while ((newline = memchr(line, '\n', depot->readBuffer +
+            depot->readLength - line)) != NULL) {
+        if (!strncmp(line, "Deliver:", 8)) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (bench->numLatencies == bench->allocatedLatencies) {
+                bench->allocatedLatencies = 2 * bench->allocatedLatencies +
+                        1024;
+                bench->latencies = realloc(bench->latencies,
+                        bench->allocatedLatencies * sizeof(double));
+            }
+            bench->latencies[bench->numLatencies++] =
+                    elapsed(&depot->batchStart, &now);
+            depot->waiting = false;
+        }
+        line = newline + 1;
+    }
+    depot->readLength = depot->readBuffer + depot->readLength - line;
+    memmove(depot->readBuffer, line, depot->readLength);
+}
+
+// Drive the workload: every depot gets a batch at a time until all the
+// messages have been sent and echoed
+// bench is the benchmark
+void run_workload(Bench *bench) {
+    struct pollfd *pfds = calloc(bench->numDepots, sizeof(struct pollfd));
+    for (int i = 0; i < bench->numDepots; i++) {
+        pfds[i].fd = bench->depots[i].fd;
+        pfds[i].events = POLLIN;
+        send_batch(bench, i);
+    }
+    while (1) {
+        bool busy = false;
+        for (int i = 0; i < bench->numDepots; i++) {
+            busy = busy || bench->depots[i].waiting;
+        }
+        if (!busy || poll(pfds, bench->numDepots, -1) < 0) {
+            break;
+        }
+        for (int i = 0; i < bench->numDepots; i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            read_echoes(bench, i);
+            long perDepot = bench->messages / bench->numDepots +
+                    (i < bench->messages % bench->numDepots);
+            if (!bench->depots[i].waiting &&
+                    bench->depots[i].sent < perDepot) {
+                send_batch(bench, i);
+            }
+        }
+    }
+    free(pfds);
+}
+
+// Compare two latencies, for use with qsort
+// a and b are the double pointers being compared
+int compare_latencies(const void *a, const void *b) {
+    double first = *(const double *)a, second = *(const double *)b;
+    return (first > second) - (first < second);
+}
+
+// Print the throughput, batch latency percentiles and a histogram of the
+// batch latencies in powers of two microseconds
+// bench is the benchmark and seconds is how long the workload took
+void report(Bench *bench, double seconds) {
+    long count = bench->numLatencies;
+    printf("messages %ld\n", bench->messages);
+    printf("seconds %.3f\n", seconds);
+    printf("messages/sec %.0f\n", bench->messages / seconds);
+    if (count == 0) {
+        return;
+    }
+    qsort(bench->latencies, count, sizeof(double), compare_latencies);
+    double percentiles[] = {0.5, 0.99, 0.999};
+    const char *names[] = {"p50", "p99", "p999"};
+    for (int i = 0; i < 3; i++) {
+        long rank = (long)(percentiles[i] * count);
+        if (rank >= count) {
+            rank = count - 1;
+        }
+        printf("%s %.1fus\n", names[i], bench->latencies[rank] * 1e6);
+    }
+    printf("histogram (batch of %d):\n", bench->batch);
+    long bucketStart = 0;
+    for (long limit = 1; bucketStart < count; limit *= 2) {
+        long bucketEnd = bucketStart;
+        while (bucketEnd < count &&
+                bench->latencies[bucketEnd] * 1e6 < limit) {
+            bucketEnd++;
+        }
+        if (bucketEnd > bucketStart) {
+            printf("<%ldus %ld\n", limit, bucketEnd - bucketStart);
+        }
+        bucketStart = bucketEnd;
+    }
+}
+
+// Stop every depot the benchmark started
+// bench is the benchmark
+void stop_depots(Bench *bench) {
+    for (int i = 0; i < bench->numDepots; i++) {
+        kill(bench->depots[i].pid, SIGTERM);
+        waitpid(bench->depots[i].pid, NULL, 0);
+    }
+}
@@ -0,0 +1,82 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Depot program started when no path is given
+#define DEFAULT_DEPOT "./2310depot"
+// Messages sent to each depot before waiting for its echo
+#define DEFAULT_BATCH 100
+// Number of different goods the workload moves around
+#define NUM_GOODS 1000
+// How long to wait for the depots to finish connecting, in milliseconds
+#define WIRE_TIMEOUT 5000
+// How long a depot's output must be quiet before its report is complete
+#define REPORT_QUIET 100
+
+// Ways of connecting the depots together
+typedef enum Topology {
+    CHAIN,
+    STAR,
+    MESH
+} Topology;
+
+// A depot started by the benchmark
+typedef struct Depot {
+    pid_t pid;
+    int port;
+    int output;
+    int fd;
+    int target;
+    int expectedNeighbours;
+
+    long sent;
+    long batches;
+    bool waiting;
+    struct timespec batchStart;
+    char readBuffer[4096];
+    size_t readLength;
+} Depot;
+
+// State of a benchmark run
+typedef struct Bench {
+    Depot *depots;
+    int numDepots;
+    Topology topology;
+    long messages;
+    int batch;
+    const char *depotPath;
+
+    double *latencies;
+    long numLatencies;
+    long allocatedLatencies;
+} Bench;
+
+void show_message(int);
+void check_args(int, char *[], Bench *);
+int read_number(char *);
+double elapsed(struct timespec *, struct timespec *);
+void start_depot(Bench *, int);
+void connect_to_depot(Bench *, int);
+void send_line(Depot *, const char *, ...);
+bool linked(Bench *, int, int);
+void wire_depots(Bench *);
+int count_neighbours(Depot *);
+void wait_for_wiring(Bench *);
+void send_batch(Bench *, int);
+void read_echoes(Bench *, int);
+void run_workload(Bench *);
+int compare_latencies(const void *, const void *);
+void report(Bench *, double);
+void stop_depots(Bench *);
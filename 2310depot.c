@@ -1,7 +1,15 @@
 #include "2310depot.h"
 
-// Global boolean to check if a SIGHUP has been recieved
-bool sighup = false;
+// Names of each MessageType, as used in the stats
+const char *messageNames[NUM_MESSAGE_TYPES] = {"Connect", "IM", "Deliver",
+        "Withdraw", "Batch", "Protocol", "Transfer", "Defer", "Execute", 
+        "Schedule", "Stats", "Route", "Forward", "Query", "Probe", "Answer", 
+        "Mirror", "Ignored"};
+
+// Stats for threads which aren't reactors, and where each thread records
+// its stats. Read with a Stats: message or SIGUSR1
+Stats stats;
+__thread Stats *threadStats = &stats;
 
 // Send error message to stderr and exit code, exitStatus gives the 
 // exit code 
@@ -14,54 +22,63 @@ void show_message(int exitStatus) {
     exit(exitStatus);
 }
 
-// Set the sighup boolean to be true, signal is the signal which
-// is called 
-void handle_sighup(const int signal) { 
-    if (signal == SIGHUP) {
-        sighup = true;
-    }
-} 
-
 // main function initially run on startup. argc is number of arguments,
 // argv is an array of those arguments
 int main(int argc, char *argv[]) {
-    // Handle sighup
-    struct sigaction sa;
-    sa.sa_handler = handle_sighup;
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGHUP, &sa, 0);
+    // SIGHUP, SIGUSR1 and SIGCHLD (from a finished snapshot) are blocked 
+    // and read from a signalfd by the event loop, so nothing has to poll
+    // for them
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
  
     check_args(argc, argv);
   
     DepotContents depotContents;   
     setup_depot(&depotContents, argc, argv);
+    depotContents.signalFd = signalfd(-1, &mask, SFD_NONBLOCK);
    
-    // make a new thread to run the netowrk
-    pthread_t threadId;
-    pthread_create(&threadId, NULL, handle_server_thread, 
-            (void *) &depotContents);
-   
-    //handle sighup
-    while (1) {
-        if (sighup) {
-            sighup = false;
-            printf("Goods:\n");
-            print_list(&depotContents, depotContents.numItems, 
-                    depotContents.type, 1);
-            printf("Neighbours:\n");
-            print_list(&depotContents, depotContents.numNeighbours,
-                    depotContents.neighbours, 0);
-            fflush(stdout);
-        }
+    if (getenv("DEPOT_REPLAY") != NULL) {
+        replay_trace(&depotContents, getenv("DEPOT_REPLAY"));
     }
+    run_server(&depotContents);
+    return 0;
 }
 
-// Wrapper function to create server
-// v is a depotContents pointer cast to a void pointer
-void *handle_server_thread(void *v) {
-    DepotContents *depotContents = (DepotContents *)v;
-    run_server(depotContents);
-    return NULL;
+// Read all pending signals from the signalfd. Print the depot's goods
+// and neighbours if a SIGHUP has been recieved and its stats for SIGUSR1,
+// and clean up after a snapshot on SIGCHLD
+// depotContents gives current state of the depot
+void handle_signals(DepotContents *depotContents) {
+    struct signalfd_siginfo info;
+    bool sighup = false;
+    bool sigusr1 = false;
+    while (read(depotContents->signalFd, &info, sizeof(info)) == 
+            sizeof(info)) {
+        if (info.ssi_signo == SIGHUP) {
+            sighup = true;
+        } else if (info.ssi_signo == SIGUSR1) {
+            sigusr1 = true;
+        } else if (info.ssi_signo == SIGCHLD) {
+            reap_snapshot(depotContents);
+        }
+    }
+    if (sigusr1) {
+        char *text = format_stats(depotContents);
+        fputs(text, stdout);
+        fflush(stdout);
+        free(text);
+    }
+    if (sighup) {
+        printf("Goods:\n");
+        print_goods(depotContents);
+        printf("Neighbours:\n");
+        print_neighbours(depotContents);
+        fflush(stdout);
+    }
 }
 
 // Create lock. l is the lock we are creating
@@ -70,8 +87,16 @@ void init_lock(sem_t *l) {
 }
 
 // Take the lock. l is the lock we are locking
+// Only a lock which is already held is timed, so the stats show how long
+// was spent waiting without slowing down the common case
 void take_lock(sem_t *l) {
+    if (sem_trywait(l) == 0) {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     sem_wait(l);
+    record_lock_wait(&start);
 }
 
 // Release the lock. l is the lock we are releasing
@@ -79,45 +104,241 @@ void release_lock(sem_t *l) {
     sem_post(l);
 }
 
+// Take a reader/writer lock for reading. l is the lock we are locking
+void take_read_lock(pthread_rwlock_t *l) {
+    if (pthread_rwlock_tryrdlock(l) == 0) {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_rdlock(l);
+    record_lock_wait(&start);
+}
+
+// Take a reader/writer lock for writing. l is the lock we are locking
+void take_write_lock(pthread_rwlock_t *l) {
+    if (pthread_rwlock_trywrlock(l) == 0) {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_rwlock_wrlock(l);
+    record_lock_wait(&start);
+}
+
+// Release a reader/writer lock. l is the lock we are releasing
+void release_rw_lock(pthread_rwlock_t *l) {
+    pthread_rwlock_unlock(l);
+}
+
+// Return the number of nanoseconds since start
+long nanos_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000L + 
+            (now.tv_nsec - start->tv_nsec);
+}
+
+// Record in the stats that we waited for a lock since start
+void record_lock_wait(struct timespec *start) {
+    __atomic_fetch_add(&threadStats->lockWaits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&threadStats->lockWaitNanos, nanos_since(start), 
+            __ATOMIC_RELAXED);
+}
+
+// Record in the stats that a message of the given type was handled, which
+// started at start
+void record_message(MessageType type, struct timespec *start) {
+    long nanos = nanos_since(start);
+    int bucket = 0;
+    while (bucket < NUM_LATENCY_BUCKETS - 1 && (nanos >> (bucket + 1)) > 0) {
+        bucket++;
+    }
+    __atomic_fetch_add(&threadStats->messages[type], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&threadStats->handlerNanos[type], nanos, 
+            __ATOMIC_RELAXED);
+    __atomic_fetch_add(&threadStats->latency[type][bucket], 1, 
+            __ATOMIC_RELAXED);
+}
+
+// Add up the stats of every thread into total
+void sum_stats(DepotContents *depotContents, Stats *total) {
+    memset(total, 0, sizeof(Stats));
+    for (int r = -1; r < depotContents->numReactors; r++) {
+        Stats *from = r == -1 ? &stats : &depotContents->reactors[r].stats;
+        for (int i = 0; i < NUM_MESSAGE_TYPES; i++) {
+            total->messages[i] += __atomic_load_n(&from->messages[i], 
+                    __ATOMIC_RELAXED);
+            total->handlerNanos[i] += __atomic_load_n(
+                    &from->handlerNanos[i], __ATOMIC_RELAXED);
+            for (int j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+                total->latency[i][j] += __atomic_load_n(
+                        &from->latency[i][j], __ATOMIC_RELAXED);
+            }
+        }
+        total->lockWaits += __atomic_load_n(&from->lockWaits, 
+                __ATOMIC_RELAXED);
+        total->lockWaitNanos += __atomic_load_n(&from->lockWaitNanos, 
+                __ATOMIC_RELAXED);
+        total->deferredDepth += __atomic_load_n(&from->deferredDepth,
+                __ATOMIC_RELAXED);
+    }
+}
+
+// Write out the depot's stats, one per line, in the form
+//   Stat:message:type:count:total nanoseconds:histogram bucket counts
+//   Stat:lock:times waited:total nanoseconds waited
+//   Stat:deferred:messages waiting to be executed
+//   Stat:connection:fd:neighbour (or -):bytes in:bytes out:bytes queued
+//   Stat:end
+// Return the text, which the caller must free
+char *format_stats(DepotContents *depotContents) {
+    Stats total;
+    sum_stats(depotContents, &total);
+    char *text;
+    size_t length;
+    FILE *out = open_memstream(&text, &length);
+    for (int i = 0; i < NUM_MESSAGE_TYPES; i++) {
+        fprintf(out, "Stat:message:%s:%lu:%lu:", messageNames[i], 
+                total.messages[i], total.handlerNanos[i]);
+        for (int j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+            fprintf(out, j ? ",%lu" : "%lu", total.latency[i][j]);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "Stat:lock:%lu:%lu\n", total.lockWaits, 
+            total.lockWaitNanos);
+    fprintf(out, "Stat:deferred:%ld\n", total.deferredDepth);
+    take_read_lock(&depotContents->neighbourLock);
+    take_lock(&depotContents->lock);
+    for (int i = 0; i < depotContents->numConnections; i++) {
+        Connection *connection = depotContents->connections[i];
+        fprintf(out, "Stat:connection:%d:%s:%lu:%lu:%lu\n", connection->fd,
+                connection->neighbour == -1 ? "-" : 
+                depotContents->neighbours[connection->neighbour],
+                __atomic_load_n(&connection->bytesIn, __ATOMIC_RELAXED),
+                __atomic_load_n(&connection->bytesOut, __ATOMIC_RELAXED),
+                (unsigned long)__atomic_load_n(&connection->queuedBytes, 
+                __ATOMIC_RELAXED));
+    }
+    release_lock(&depotContents->lock);
+    release_rw_lock(&depotContents->neighbourLock);
+    fprintf(out, "Stat:end\n");
+    fclose(out);
+    return text;
+}
+
+// Reply to a Stats message with the depot's stats, one message per line
+// connection is where the reply is going
+void send_stats(DepotContents *depotContents, Connection *connection) {
+    char *text = format_stats(depotContents);
+    char *line = text;
+    char *newline;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        send_message(connection, "%s\n", line);
+        line = newline + 1;
+    }
+    free(text);
+}
+
 // Setup depot and initialise memory. depotContents gives current state of
 // the depot, argc gives the number of arguments and argv is an array of 
 // those arguments
 void setup_depot(DepotContents *depotContents, int argc, char *argv[]) {
     int numGoods = (argc - 1) / 2;
-    depotContents->numItems = numGoods;
-    // allocate mem for names of goods
-    depotContents->allocatedGoods = numGoods + 10;
-    depotContents->type = malloc((numGoods + 10) * sizeof(char *));
-    for (int i = 0; i < numGoods; i++) {
-        depotContents->type[i] = malloc(strlen(argv[2 + 2 * i]) * 
-                sizeof(char));
+    // size the goods table so it starts at most half full
+    depotContents->numItems = 0;
+    depotContents->allocatedGoods = MIN_GOODS_SLOTS;
+    while (depotContents->allocatedGoods < 2 * numGoods) {
+        depotContents->allocatedGoods *= 2;
     }
-    // allocate quantity
-    depotContents->quantity = malloc((numGoods + 10) * sizeof(int)); 
+    depotContents->goods = calloc(depotContents->allocatedGoods, 
+            sizeof(Good));
+    depotContents->goodSlots = malloc(depotContents->allocatedGoods * 
+            sizeof(int));
+    memset(&depotContents->names, 0, sizeof(NamePool));
 
-    // populate struct
-    for (int i = 0; i < numGoods; i++) {
-        depotContents->type[i] = argv[2 + 2 * i];
-        depotContents->quantity[i] = check_valid_number(argv[3 + 2 * i], 0);
-    }
-
-    // setup lock
+    // setup locks
     init_lock(&depotContents->lock);
-   
+    pthread_rwlock_init(&depotContents->goodsLock, NULL);
+    pthread_rwlock_init(&depotContents->neighbourLock, NULL);
+
     depotContents->allocatedConnections = 10;
     depotContents->numConnections = 0;
-    depotContents->tid = malloc(10 * sizeof(pthread_t));
-    depotContents->rstream = malloc(10 * sizeof(FILE *));
-    depotContents->wstream = malloc(10 * sizeof(FILE *));
-    depotContents->messageSent = malloc(10 * sizeof(bool));
-    depotContents->deferredMessages = malloc(10 * sizeof(DeferredMessage));
-    depotContents->allocatedDeferredMessages = 10;
+    depotContents->connections = malloc(10 * sizeof(Connection *));
+    depotContents->deferredMessages = malloc(MIN_DEFERRED_SLOTS * 
+            sizeof(DeferredMessage));
+    for (int i = 0; i < MIN_DEFERRED_SLOTS; i++) {
+        depotContents->deferredMessages[i].key = NO_KEY;
+    }
+    depotContents->allocatedDeferredMessages = MIN_DEFERRED_SLOTS;
     depotContents->numDeferredMessages = 0;
     depotContents->allocatedNeighbours = 10;
     depotContents->neighbours = malloc(10 * sizeof(char *));
     depotContents->neighbourPorts = malloc(10 * sizeof(int));
+    depotContents->neighbourConnections = malloc(10 * sizeof(Connection *));
+    depotContents->nextSameName = malloc(10 * sizeof(int));
+    depotContents->allocatedIndex = MIN_NEIGHBOUR_SLOTS;
+    depotContents->nameIndex = malloc(MIN_NEIGHBOUR_SLOTS * sizeof(int));
+    depotContents->portIndex = malloc(MIN_NEIGHBOUR_SLOTS * sizeof(int));
+    memset(depotContents->nameIndex, -1, MIN_NEIGHBOUR_SLOTS * sizeof(int));
+    memset(depotContents->portIndex, -1, MIN_NEIGHBOUR_SLOTS * sizeof(int));
     depotContents->numNeighbours = 0;
+    depotContents->allocatedRoutes = MIN_ROUTE_SLOTS;
+    depotContents->numRoutes = 0;
+    depotContents->routes = calloc(MIN_ROUTE_SLOTS, sizeof(Route));
+    memset(&depotContents->routeNames, 0, sizeof(NamePool));
     depotContents->name = argv[1];
+    depotContents->reactors = NULL;
+    depotContents->numReactors = 0;
+    depotContents->connectTimeout = config_value("DEPOT_CONNECT_TIMEOUT",
+            CONNECT_TIMEOUT);
+    depotContents->connectAttempts = config_value("DEPOT_CONNECT_ATTEMPTS",
+            CONNECT_ATTEMPTS);
+    depotContents->peerMessages = config_value("DEPOT_PEER_MESSAGES", 0);
+    depotContents->peerBytes = config_value("DEPOT_PEER_BYTES", 0);
+    depotContents->messageLimit = config_value("DEPOT_MAX_MESSAGE", 
+            MAX_MESSAGE);
+    depotContents->deferLimit = config_value("DEPOT_DEFER_BYTES", 
+            DEFER_BYTES);
+    depotContents->deferredBytes = 0;
+    depotContents->deferTtl = config_value("DEPOT_DEFER_TTL", 0);
+    memset(&depotContents->timers, 0, sizeof(TimerWheel));
+    pthread_mutex_init(&depotContents->timers.lock, NULL);
+    depotContents->timers.now = current_millis() / TIMER_TICK;
+    depotContents->mirrors = NULL;
+    depotContents->numMirrors = 0;
+    depotContents->allocatedMirrors = 0;
+    pthread_mutex_init(&depotContents->mirrorLock, NULL);
+    depotContents->changedGoods = NULL;
+    depotContents->numChanged = 0;
+    depotContents->allocatedChanged = 0;
+    depotContents->mirrorSerial = 0;
+    depotContents->mirrorInterval = config_value("DEPOT_MIRROR_INTERVAL",
+            MIRROR_INTERVAL);
+    depotContents->nextMirrorFlush = 0;
+    depotContents->followName = NULL;
+    depotContents->followSerial = 0;
+    pthread_mutex_init(&depotContents->queryLock, NULL);
+    depotContents->queries = NULL;
+    depotContents->numQueries = 0;
+    depotContents->allocatedQueries = 0;
+    depotContents->nextSerial = 0;
+    memset(depotContents->answers, 0, sizeof(depotContents->answers));
+    depotContents->queryTimeout = config_value("DEPOT_QUERY_TIMEOUT", 
+            QUERY_TIMEOUT);
+    depotContents->queryTtl = config_value("DEPOT_QUERY_TTL", QUERY_TTL);
+
+    open_capture(depotContents);
+    // populate struct, unless it has been restored from the journal
+    if (open_journal(depotContents)) {
+        return;
+    }
+    for (int i = 0; i < numGoods; i++) {
+        add_goods(depotContents, argv[2 + 2 * i], 
+                check_valid_number(argv[3 + 2 * i], 0));
+    }
 }
 
 // Check to see the given arguments are valid, argc is the number of
@@ -198,527 +419,4537 @@ int check_valid_number(char *input, int type) {
     return inputValue;
 } 
 
-// If the good is in the depot, return its index, else return -1
-int good_at_depot(DepotContents *depotContents, char *name) {
-    for (int i = 0; i < depotContents->numItems; i++) {
-        if (!strcmp(name, depotContents->type[i])) {
+// Hash a goods name (FNV-1a). name is the name we are hashing
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// If the good is in the depot, return its slot in the goods table, else 
+// return -1. name is the good we are looking for and hash is its hash
+int good_at_depot(DepotContents *depotContents, char *name, 
+        unsigned int hash) {
+    size_t mask = depotContents->allocatedGoods - 1;
+    for (size_t i = hash & mask; depotContents->goods[i].name != NULL; 
+            i = (i + 1) & mask) {
+        if (depotContents->goods[i].hash == hash && 
+                !strcmp(name, depotContents->goods[i].name)) {
             return i;
         }
     }
     return -1;
 }
 
-// Add a given amount of goods to the appropriate good type
-void add_goods(DepotContents *depotContents, char *name, int quantity) {
-    // If not already in list
-    int index = good_at_depot(depotContents, name);
-    if (index != -1) {
-        take_lock(&depotContents->lock);
-        depotContents->quantity[index] += quantity;
-        release_lock(&depotContents->lock);
-        return;
+// Double the size of the goods table and rehash every good into it
+// The goods lock must be held for writing by the caller
+void grow_goods(DepotContents *depotContents) {
+    size_t oldSize = depotContents->allocatedGoods;
+    Good *oldGoods = depotContents->goods;
+    size_t mask = oldSize * 2 - 1;
+    Good *goods = calloc(oldSize * 2, sizeof(Good));
+    if (goods == NULL) {
+        //memory failure
+        exit(99);
     }
-    //remalloc every 10
-    take_lock(&depotContents->lock);
-    depotContents->numItems++;
-    if (depotContents->numItems == depotContents->allocatedGoods) {
-        // remalloc 
-        depotContents->allocatedGoods += 10;
-        int memSize = depotContents->allocatedGoods;
-        char **tempType = realloc(depotContents->type, 
-                memSize * sizeof(char *));
-        int *tempQuantity = realloc(depotContents->quantity, 
-                memSize * sizeof(int));
-        if ((tempType == NULL) || (tempQuantity == NULL)) {
+    for (size_t i = 0; i < oldSize; i++) {
+        if (oldGoods[i].name == NULL) {
+            continue;
+        }
+        size_t slot = oldGoods[i].hash & mask;
+        while (goods[slot].name != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        goods[slot] = oldGoods[i];
+    }
+    int *goodSlots = realloc(depotContents->goodSlots, 
+            oldSize * 2 * sizeof(int));
+    if (goodSlots == NULL) {
+        //memory failure
+        exit(99);
+    }
+    for (size_t i = 0; i < oldSize * 2; i++) {
+        if (goods[i].name != NULL) {
+            goodSlots[goods[i].id] = i;
+        }
+    }
+    depotContents->goodSlots = goodSlots;
+    depotContents->goods = goods;
+    depotContents->allocatedGoods = oldSize * 2;
+    free(oldGoods);
+}
+
+// Copy a name into a name pool. The lock guarding the pool must be held
+// for writing by the caller. pool is the pool and name is the name to 
+// copy. Return the copy
+char *intern_name(NamePool *pool, char *name) {
+    size_t length = strlen(name) + 1;
+    if (pool->block == NULL || pool->blockSize - pool->used < length) {
+        // what is left of the old block is wasted, but names are short
+        pool->blockSize = length > NAME_BLOCK ? length : NAME_BLOCK;
+        pool->block = malloc(pool->blockSize);
+        pool->used = 0;
+        if (pool->block == NULL) {
             //memory failure
             exit(99);
-        } else {
-            depotContents->type = tempType;
-            depotContents->quantity = tempQuantity;
         }
     }
-    
-    depotContents->type[depotContents->numItems - 1] = malloc(strlen(name) 
-            * sizeof(char));
-    depotContents->type[depotContents->numItems - 1] = name;
-    depotContents->quantity[depotContents->numItems - 1] = quantity;
-    release_lock(&depotContents->lock);
+    char *copy = memcpy(pool->block + pool->used, name, length);
+    pool->used += length;
+    return copy;
 }
 
-// check if the given integer is in the given list
-// listLength gives lenth of list, list is the list itself and
-// item is the item we are checking is present in the list
-// return true if list contains item, else false
-bool list_contains(int listLength, int *list, int item) {
-    for (int i = 0; i < listLength; i++) {
-        if (list[i] == item) {
-            return true;
+// Add a given amount of goods to a good, adding the good to the table if 
+// it isn't there yet. The goods lock must be held for writing by the caller
+// name is the good, hash is its hash and quantity is the amount to add
+// Return the id of the good
+int insert_good(DepotContents *depotContents, char *name, unsigned int hash,
+        int quantity) {
+    // someone else may have added it while we weren't holding the lock
+    int index = good_at_depot(depotContents, name, hash);
+    if (index != -1) {
+        depotContents->goods[index].quantity += quantity;
+        note_change(depotContents, &depotContents->goods[index]);
+        return depotContents->goods[index].id;
+    }
+    // If not already in table, keep it at most half full
+    if (2 * (depotContents->numItems + 1) > depotContents->allocatedGoods) {
+        grow_goods(depotContents);
+    }
+    size_t mask = depotContents->allocatedGoods - 1;
+    size_t slot = hash & mask;
+    while (depotContents->goods[slot].name != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    int id = depotContents->numItems++;
+    depotContents->goods[slot].name = intern_name(&depotContents->names, 
+            name);
+    depotContents->goods[slot].hash = hash;
+    depotContents->goods[slot].quantity = quantity;
+    depotContents->goods[slot].id = id;
+    depotContents->goodSlots[id] = slot;
+    note_change(depotContents, &depotContents->goods[slot]);
+    return id;
+}
+
+// Return the id of a good, adding it to the table with none held if the 
+// depot hasn't seen it before. name is the good
+int intern_good(DepotContents *depotContents, char *name) {
+    unsigned int hash = hash_name(name);
+    take_read_lock(&depotContents->goodsLock);
+    int index = good_at_depot(depotContents, name, hash);
+    if (index == -1) {
+        release_rw_lock(&depotContents->goodsLock);
+        take_write_lock(&depotContents->goodsLock);
+        // inserting it may grow the table, so the slot is found after
+        int id = insert_good(depotContents, name, hash, 0);
+        index = depotContents->goodSlots[id];
+    }
+    int id = depotContents->goods[index].id;
+    release_rw_lock(&depotContents->goodsLock);
+    return id;
+}
+
+// Add a given amount of goods to the appropriate good type
+// Goods already in the table are updated atomically under the read lock,
+// so only new goods (and growing the table) need the write lock
+void add_goods(DepotContents *depotContents, char *name, int quantity) {
+    log_goods(depotContents, name, quantity);
+    unsigned int hash = hash_name(name);
+    take_read_lock(&depotContents->goodsLock);
+    int index = good_at_depot(depotContents, name, hash);
+    if (index != -1) {
+        __atomic_fetch_add(&depotContents->goods[index].quantity, quantity,
+                __ATOMIC_RELAXED);
+        note_change(depotContents, &depotContents->goods[index]);
+        release_rw_lock(&depotContents->goodsLock);
+        return;
+    }
+    release_rw_lock(&depotContents->goodsLock);
+
+    take_write_lock(&depotContents->goodsLock);
+    insert_good(depotContents, name, hash, quantity);
+    release_rw_lock(&depotContents->goodsLock);
+}
+
+// Add a given amount of goods to the good with the given id, which the 
+// depot must already have. This saves looking up a good named by a peer
+// which has already defined it
+void add_goods_by_id(DepotContents *depotContents, int id, int quantity) {
+    take_read_lock(&depotContents->goodsLock);
+    Good *good = &depotContents->goods[depotContents->goodSlots[id]];
+    log_goods(depotContents, good->name, quantity);
+    __atomic_fetch_add(&good->quantity, quantity, __ATOMIC_RELAXED);
+    note_change(depotContents, good);
+    release_rw_lock(&depotContents->goodsLock);
+}
+
+// Apply many goods changes at once, as one change under a single hold of
+// the goods write lock, so no one sees some of them done and not others.
+// Each item is looked up once, and added to the table if it is new. The 
+// items are journalled together with one reservation
+// items is the list of changes and numItems is how many there are
+void add_goods_batch(DepotContents *depotContents, BatchItem *items, 
+        int numItems) {
+    size_t logLength = 0;
+    for (int i = 0; i < numItems; i++) {
+        logLength += MAX_LOG_RECORD + strlen(items[i].name);
+    }
+    take_write_lock(&depotContents->goodsLock);
+    unsigned char *record = NULL;
+    size_t used = 0;
+    if (depotContents->journal.enabled && numItems > 0) {
+        record = reserve_journal(&depotContents->journal, logLength);
+    }
+    for (int i = 0; i < numItems; i++) {
+        insert_good(depotContents, items[i].name, items[i].hash, 
+                items[i].quantity);
+        if (record != NULL) {
+            used += put_goods_record(record + used, items[i].name, 
+                    items[i].quantity);
         }
     }
-    return false;
+    if (record != NULL) {
+        commit_journal(&depotContents->journal, used);
+    }
+    release_rw_lock(&depotContents->goodsLock);
+}
+
+// Compare two list entries by name, for use with qsort
+// a and b are the ListEntry pointers being compared
+int compare_entries(const void *a, const void *b) {
+    return strcmp(((const ListEntry *)a)->name, ((const ListEntry *)b)->name);
 }
 
 // Order and print the given list in lexographic order
-// depotContents gives current state of the depot, listLength tells us the 
-// length of the list and list is the list we are to print out, type 
-// checks if we are printing neighbours or goods (1 = goods, 0 = neighbours)
-void print_list(DepotContents *depotContents, int listLength, char **list, 
-        int type) {
-    take_lock(&depotContents->lock);
-    //need to lexographically order the items
-    char **orderedType = malloc(listLength * sizeof(char *));
-    int *orderedQuantity = malloc(listLength * sizeof(int));
-    int *alreadyOrdered = malloc(listLength * sizeof(int));
-   
-    for (int i = 0; i < listLength; i++) {
-        alreadyOrdered[i] = -1;
-    }  
+// list is the list we are to print out, listLength tells us the length of 
+// the list and showQuantity is true when printing goods
+void print_list(ListEntry *list, int listLength, bool showQuantity) {
+    qsort(list, listLength, sizeof(ListEntry), compare_entries);
     for (int i = 0; i < listLength; i++) {
-        int minIndex;
-        // Find first element in list which hasnt already been added
-        for (int index = 0; index < listLength; index++) {
-            if (!list_contains(listLength, alreadyOrdered, 
-                    index)) {
-                minIndex = index;
-                break;
-            }
-        } 
-        // Compare this element to every other in list, to find minimum
-        for (int j = 0; j < listLength; j++) {
-            if (minIndex != j && !list_contains(listLength, 
-                    alreadyOrdered, j)) {
-                int comparison = strcmp(list[minIndex], list[j]);
-                if (comparison >= 0) {
-                    minIndex = j;
-                }  
-            }
+        if (showQuantity) {
+            printf("%s %d\n", list[i].name, list[i].quantity);
+        } else {
+            printf("%s\n", list[i].name);
         }
-        alreadyOrdered[i] = minIndex;
-        orderedType[i] = list[minIndex];
-        if (type) {
-            orderedQuantity[i] = depotContents->quantity[minIndex];
+    }
+}
+
+// Print every good held by the depot in lexographic order. Goods names are 
+// never freed, so only a snapshot of the pointers is taken under the lock
+// and the sorting and printing happen after it is released
+// depotContents gives current state of the depot
+void print_goods(DepotContents *depotContents) {
+    take_read_lock(&depotContents->goodsLock);
+    ListEntry *list = malloc((depotContents->numItems + 1) * 
+            sizeof(ListEntry));
+    int listLength = 0;
+    for (size_t i = 0; i < depotContents->allocatedGoods; i++) {
+        Good *good = &depotContents->goods[i];
+        if (good->name != NULL && __atomic_load_n(&good->quantity, 
+                __ATOMIC_RELAXED) != 0) {
+            list[listLength].name = good->name;
+            list[listLength++].quantity = __atomic_load_n(&good->quantity,
+                    __ATOMIC_RELAXED);
         }
-    }  
+    }
+    release_rw_lock(&depotContents->goodsLock);
+    print_list(list, listLength, true);
+    free(list);
+}
+
+// Print every neighbour of the depot in lexographic order
+// depotContents gives current state of the depot
+void print_neighbours(DepotContents *depotContents) {
+    take_read_lock(&depotContents->neighbourLock);
+    int listLength = depotContents->numNeighbours;
+    ListEntry *list = malloc((listLength + 1) * sizeof(ListEntry));
     for (int i = 0; i < listLength; i++) {
-        if (type && orderedQuantity[i] == 0) {
-            continue;
-        } 
-        printf("%s", orderedType[i]);
-        if (type) {
-            printf(" %d", orderedQuantity[i]);
-        }
-        printf("\n");
+        list[i].name = depotContents->neighbours[i];
     }
-    free(orderedType);
-    free(orderedQuantity);
-    free(alreadyOrdered);
-    release_lock(&depotContents->lock);
+    release_rw_lock(&depotContents->neighbourLock);
+    print_list(list, listLength, false);
+    free(list);
 }
 
 // Run the depot server which can be connected to
-// This function will be continuously running to check for new connections
-// depotContents gives the current state of the depot
+// This starts the reactors, which run the event loops owning the listening
+// sockets and every peer connection. The first runs on this thread and 
+// also handles signals. depotContents gives the current state of the depot
 void run_server(DepotContents *depotContents) {
-    struct addrinfo *ai = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;        // IPv6  for generic could use AF_UNSPEC
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;  // Because we want to bind with it    
-    int err;
-    if ((err = getaddrinfo("127.0.0.1", 0, &hints, &ai))) {
-        freeaddrinfo(ai);
-        return;   // could not work out the address
-    }   
-    // create a socket and bind it to a port
-    int serv = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
-    if (bind(serv, (struct sockaddr *)ai->ai_addr, sizeof(struct sockaddr))) {
-        return;
+    int numReactors = config_value("DEPOT_REACTORS", DEFAULT_REACTORS);
+    depotContents->reactors = calloc(numReactors, sizeof(Reactor));
+    depotContents->numReactors = numReactors;
+    pthread_mutex_init(&depotContents->pauseLock, NULL);
+    pthread_cond_init(&depotContents->pauseChanged, NULL);
+    depotContents->pauseRequested = false;
+    depotContents->numPaused = 0;
+
+    // the first listening socket picks the port and the rest share it
+    int port = 0;
+    for (int i = 0; i < numReactors; i++) {
+        Reactor *reactor = &depotContents->reactors[i];
+        reactor->index = i;
+        reactor->depotContents = depotContents;
+        reactor->serverFd = open_listener(port);
+        if (reactor->serverFd == -1) {
+            return;
+        }
+        if (i == 0) {
+            // Which port did we get?
+            struct sockaddr_in ad;
+            memset(&ad, 0, sizeof(struct sockaddr_in));
+            socklen_t len = sizeof(struct sockaddr_in);
+            if (getsockname(reactor->serverFd, (struct sockaddr *)&ad, 
+                    &len)) {
+                return;
+            }
+            port = ntohs(ad.sin_port);
+        }
+        reactor->epollFd = epoll_create1(0);
+        reactor->inboxFd = eventfd(0, EFD_NONBLOCK);
+        pthread_mutex_init(&reactor->inboxLock, NULL);
+        // the listening socket, inbox and signalfd are registered with 
+        // pointers to their descriptors so they can be told apart from 
+        // peer connections
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &reactor->serverFd;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->serverFd, 
+                &event);
+        event.data.ptr = &reactor->inboxFd;
+        epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, reactor->inboxFd, &event);
+        if (i == 0) {
+            event.data.ptr = &depotContents->signalFd;
+            epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, 
+                    depotContents->signalFd, &event);
+        }
     }
-             
-    // Which port did we get?
-    struct sockaddr_in ad;
-    memset(&ad, 0, sizeof(struct sockaddr_in));
-    socklen_t len = sizeof(struct sockaddr_in);
-    if (getsockname(serv, (struct sockaddr *)&ad, &len)) {
-        return;
+
+    // depots on this host can use a Unix domain socket instead, unless
+    // DEPOT_LOCAL is 0. Every reactor waits for it, but only one is woken
+    // for each connection
+    char *local = getenv("DEPOT_LOCAL");
+    int localFd = local != NULL && !strcmp(local, "0") ? -1 : 
+            open_local_listener(port);
+    for (int i = 0; i < numReactors; i++) {
+        Reactor *reactor = &depotContents->reactors[i];
+        reactor->localFd = localFd;
+        if (localFd != -1) {
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            event.data.ptr = &reactor->localFd;
+            epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, localFd, &event);
+        }
     }
-      
+
+    // only announce the port once connections to it will be accepted
     take_lock(&depotContents->lock);
-    printf("%u\n", ntohs(ad.sin_port));
+    printf("%u\n", port);
     fflush(stdout);  
-    depotContents->port = ntohs(ad.sin_port);          
+    depotContents->port = port;          
     release_lock(&depotContents->lock); 
 
-    if (listen(serv, 10)) {     // allow up to 10 connection requests to queue
+    for (int i = 1; i < numReactors; i++) {
+        pthread_create(&depotContents->reactors[i].thread, NULL, 
+                reactor_thread, &depotContents->reactors[i]);
+    }
+    run_reactor(depotContents, &depotContents->reactors[0]);
+}   
+
+// Create a non-blocking socket listening on the given port of localhost,
+// which other sockets can listen on too. port is 0 to pick any free port
+// Return the socket, or -1 if it couldn't be bound
+int open_listener(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int serv = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
+    int on = 1;
+    setsockopt(serv, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if (bind(serv, (struct sockaddr *)&address, sizeof(address))) {
+        close(serv);
+        return -1;
+    }
+    if (listen(serv, SOMAXCONN)) {
         perror("Listen");
         exit(4);
     }                                                            
-    int connFd; 
-    while (connFd = accept(serv, 0, 0), connFd >= 0) {
-        take_lock(&depotContents->lock);
-        int connFdDup = dup(connFd);
-        depotContents->rstream[depotContents->numConnections] = 
-                fdopen(connFd, "r");
-        depotContents->wstream[depotContents->numConnections] =
-                fdopen(connFdDup, "w");
-        depotContents->numConnections++;
-        release_lock(&depotContents->lock);
-        pthread_create(&depotContents->tid[depotContents->numConnections - 1],
-                NULL, handle_connection, (void *)depotContents);
-    }
-}   
+    set_nonblocking(serv);
+    return serv;
+}
 
-// Thread wraper function to handle incoming connection
-// v is a depotContents pointer cast to a void pointer
-void *handle_connection(void *v) {
-    DepotContents *depotContents = (DepotContents *)v;
-    take_lock(&depotContents->lock);
-    if (depotContents->numConnections == depotContents->allocatedConnections) {
-        depotContents->allocatedConnections += 10;
-        depotContents->rstream = realloc(depotContents->rstream,
-                depotContents->allocatedConnections * sizeof(FILE *));
-        depotContents->tid = realloc(depotContents->tid, 
-                depotContents->allocatedConnections * sizeof(pthread_t));
-        depotContents->wstream = realloc(depotContents->wstream,
-                depotContents->allocatedConnections * sizeof(FILE *));
-        depotContents->messageSent = realloc(depotContents->messageSent,
-                depotContents->allocatedConnections * sizeof(bool));
-    }    
-    release_lock(&depotContents->lock);
-    read_from_stream(depotContents, depotContents->
-            rstream[get_tid(depotContents)], true);
-    take_lock(&depotContents->lock);
-    fclose(depotContents->rstream[get_tid(depotContents)]);
-    fclose(depotContents->wstream[get_tid(depotContents)]);
-    release_lock(&depotContents->lock);
-    return NULL;
+// Fill in the address of the Unix domain socket of the depot on the given
+// port. address is where to put it. Return the length of the address
+socklen_t local_address(struct sockaddr_un *address, int port) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    // a leading NUL puts it in the abstract namespace, so there is no 
+    // file to clean up when the depot exits
+    int length = snprintf(address->sun_path + 1, 
+            sizeof(address->sun_path) - 1, LOCAL_NAME, port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + length;
 }
 
-// Get the index ID of the current thread
-// depotContents gives current state of the depot
-int get_tid(DepotContents *depotContents) {
-    for (int i = 0; i < 10; i++) { 
-        if (pthread_self() == depotContents->tid[i]) {
-            return i;
+// Create a non-blocking Unix domain socket listening for depots on this
+// host, named after our port. Return the socket, or -1 if it couldn't be
+// bound, in which case the error is reported and depots connect to us 
+// through TCP
+int open_local_listener(int port) {
+    struct sockaddr_un address;
+    socklen_t length = local_address(&address, port);
+    int serv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serv == -1 || bind(serv, (struct sockaddr *)&address, length) ||
+            listen(serv, SOMAXCONN)) {
+        perror("Local socket");
+        if (serv != -1) {
+            close(serv);
         }
+        return -1;
     }
-    return -1;
+    set_nonblocking(serv);
+    return serv;
 }
 
-// Read a line from the given stream (a message to the depot)
-// depotContents gives current state of depot, stream is the stream we
-// wish to read from and initial tells us if this is a new connection
-void read_from_stream(DepotContents *depotContents, FILE *stream, 
-        bool initial) {
-    int c = EOF;
-    int currentSize = 100;
-    char *message = malloc(100 * sizeof(char));   
-    int i = 0;  
-    while (c = fgetc(stream), c != '\n') {
-        message[i++] = (char)c; 
-        if (i == currentSize) {
-            currentSize += 100;
-            message = realloc(message, currentSize * sizeof(char));
-        }
-    } 
-    fflush(stream);
-    message[i] = '\0';
-    interpret_message(depotContents, message, initial);
- 
-    if (c != EOF) {
-        read_from_stream(depotContents, stream, false);
+// Connect to the Unix domain socket of the depot on the given port, 
+// without blocking. Return the socket, or -1 if it has none or it is 
+// held by another user
+int connect_local(int port) {
+    struct sockaddr_un address;
+    socklen_t length = local_address(&address, port);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return -1;
     }
+    // any process can bind an abstract name, so only trust one run by us
+    // (or root); anything else is reached through TCP like a remote depot
+    struct ucred peer;
+    socklen_t peerLength = sizeof(peer);
+    if (connect(fd, (struct sockaddr *)&address, length) || 
+            getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) ||
+            (peer.uid != getuid() && peer.uid != 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-// Interpret a given message and send it to currect function
-// depotContent gives current state, message is the message we are
-// interpretting and initial tells us if this is the first message
-// from a new connection
-void interpret_message(DepotContents *depotContents, char *message, 
-        bool initial) {
-    if (initial && strncmp(message, "IM:", 3)) {   
-        return;
-    }    
-    if (!strncmp(message, "Connect:", 8)) { 
-        message += 8;
-        connect_depots(depotContents, message);
-    } else if (!strncmp(message, "IM:", 3)) {        
-        if (!initial) {
-            return;
-        }
-        message += 3;
-        add_neighbour(depotContents, message);
-    } else if (!strncmp(message, "Deliver:", 8)) {
-        message += 8;
-        move_items(depotContents, message, 1);
-    } else if (!strncmp(message, "Withdraw:", 9)) {
-        message += 9;
-        move_items(depotContents, message, -1); 
-    } else if (!strncmp(message, "Transfer:", 9)) {
-        message += 9;
-        transfer(depotContents, message);
-    } else if (!strncmp(message, "Defer:", 6)) {
-        message += 6;
-        defer_message(depotContents, message);
-    } else if (!strncmp(message, "Execute:", 8)) {
-        message += 8;
-        execute_message(depotContents, message);
-    }
-} 
+// Thread which runs a reactor other than the first. arg is the reactor
+void *reactor_thread(void *arg) {
+    Reactor *reactor = arg;
+    run_reactor(reactor->depotContents, reactor);
+    return NULL;
+}
 
-// A function to handle moving items, type: 1 = addition, -1 = removal
-// depotContents gives current state of depot and message is the received
-// info from another depot
-void move_items(DepotContents *depotContents, char *message, int type) {
-    int quantity = check_valid_number(message, 1);
-    if (quantity < 0) {
-        return;
-    }
-    if (quantity != -1) {
-        while (message[0] != ':') {
-            message++;
+// Run the event loop of a reactor
+// depotContents gives the current state of the depot and reactor is the
+// reactor we are running
+void run_reactor(DepotContents *depotContents, Reactor *reactor) {
+    threadStats = &reactor->stats;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int wait = connect_wait(reactor);
+        // queries which time out are answered by the first reactor
+        int queryWait = reactor->index == 0 ? query_wait(depotContents) : -1;
+        if (queryWait != -1 && (wait == -1 || queryWait < wait)) {
+            wait = queryWait;
         }
-        //check valid name of good
-        message++;
-        if (valid_name(message)) {
-            if (type == 1) {
-                // Deliver
-                add_goods(depotContents, message, quantity);
-            } else if (type == -1) {
-                // Withdraw
-                add_goods(depotContents, message, 0 - quantity);  
+        int timerWait = reactor->index == 0 ? timer_wait(depotContents) : -1;
+        if (timerWait != -1 && (wait == -1 || timerWait < wait)) {
+            wait = timerWait;
+        }
+        int mirrorWait = reactor->index == 0 ? mirror_wait(depotContents) : 
+                -1;
+        if (mirrorWait != -1 && (wait == -1 || mirrorWait < wait)) {
+            wait = mirrorWait;
+        }
+        int throttleWait = throttle_wait(reactor);
+        if (throttleWait != -1 && (wait == -1 || throttleWait < wait)) {
+            wait = throttleWait;
+        }
+        int numEvents = epoll_wait(reactor->epollFd, events, MAX_EVENTS, 
+                wait);
+        if (numEvents < 0 && errno != EINTR) {
+            perror("Epoll");
+            exit(4);
+        }
+        for (int i = 0; i < numEvents; i++) {
+            if (events[i].data.ptr == &reactor->serverFd) {
+                accept_connections(depotContents, reactor, 
+                        reactor->serverFd);
+            } else if (events[i].data.ptr == &reactor->localFd) {
+                accept_connections(depotContents, reactor, 
+                        reactor->localFd);
+            } else if (events[i].data.ptr == &reactor->inboxFd) {
+                drain_inbox(depotContents, reactor);
+            } else if (events[i].data.ptr == &depotContents->signalFd) {
+                handle_signals(depotContents);
+            } else {
+                handle_event(depotContents, events[i].data.ptr, 
+                        events[i].events);
             }
         }
+        if (reactor->throttledConnections != NULL) {
+            check_throttled(depotContents, reactor);
+        }
+        if (reactor->index == 0) {
+            check_queries(depotContents, reactor);
+            run_timers(depotContents);
+            flush_mirrors(depotContents, reactor);
+        }
+        // send everything queued while handling these events
+        flush_dirty(reactor);
+        flush_capture(depotContents);
+        check_connects(depotContents, reactor);
+        check_snapshot(depotContents, reactor);
+        if (__atomic_load_n(&depotContents->pauseRequested, 
+                __ATOMIC_ACQUIRE)) {
+            wait_while_paused(depotContents);
+        }
     }
 }
 
-// Check to see if the given port is a new connection or not
-// depotContents gives current state of depot and port is the
-// port which we are checking
-bool new_port(DepotContents *depotContents, int port) {
-    for (int i = 0; i < depotContents->numNeighbours; i++) {
-        if (depotContents->neighbourPorts[i] == port) {
-            return false;
+// Hand an entry to a reactor, waking it if its inbox was empty
+// reactor is the reactor to give it to, entry is the entry and name is
+// the entry's name, entry->length bytes long (or NULL if it has none)
+void post_to_reactor(Reactor *reactor, InboxEntry *entry, const char *name) {
+    size_t size = sizeof(InboxEntry) + entry->length;
+    pthread_mutex_lock(&reactor->inboxLock);
+    bool wasEmpty = reactor->inboxLength == 0;
+    if (reactor->inboxLength + size > reactor->inboxAllocated) {
+        size_t allocated = reactor->inboxAllocated ? 
+                reactor->inboxAllocated : READ_CHUNK;
+        while (allocated < reactor->inboxLength + size) {
+            allocated *= 2;
         }
-    } 
-    return true;
+        reactor->inbox = realloc(reactor->inbox, allocated);
+        reactor->inboxAllocated = allocated;
+    }
+    memcpy(reactor->inbox + reactor->inboxLength, entry, 
+            sizeof(InboxEntry));
+    if (entry->length > 0) {
+        memcpy(reactor->inbox + reactor->inboxLength + sizeof(InboxEntry), 
+                name, entry->length);
+    }
+    reactor->inboxLength += size;
+    pthread_mutex_unlock(&reactor->inboxLock);
+    if (wasEmpty) {
+        uint64_t one = 1;
+        write(reactor->inboxFd, &one, sizeof(one));
+    }
 }
 
-// Check if the given key is new (i.e hasn't been used before)
-// newKey is variable we set to true if it is new, and keyIndex
-// gives the index of the key if it is not a new key
-void new_key(DepotContents *depotContents, bool *newKey, int *keyIndex, 
-        int key) {
-    for (int i = 0; i < depotContents->numDeferredMessages; i++) {
-        if (depotContents->deferredMessages[i].key == key) {
-            *newKey = false;
-            *keyIndex = i;
-            break;
+// Do everything other reactors have handed to this one
+// depotContents gives the current state of the depot and reactor is the
+// reactor whose inbox we are emptying
+void drain_inbox(DepotContents *depotContents, Reactor *reactor) {
+    uint64_t count;
+    while (read(reactor->inboxFd, &count, sizeof(count)) == sizeof(count)) {
+    }
+    pthread_mutex_lock(&reactor->inboxLock);
+    char *inbox = reactor->inbox;
+    size_t length = reactor->inboxLength;
+    reactor->inbox = NULL;
+    reactor->inboxLength = 0;
+    reactor->inboxAllocated = 0;
+    pthread_mutex_unlock(&reactor->inboxLock);
+
+    size_t offset = 0;
+    while (offset < length) {
+        InboxEntry entry;
+        memcpy(&entry, inbox + offset, sizeof(InboxEntry));
+        char *name = inbox + offset + sizeof(InboxEntry);
+        offset += sizeof(InboxEntry) + entry.length;
+        if (entry.type == INBOX_CONNECT) {
+            connect_to_port(depotContents, reactor, entry.port);
+            continue;
+        }
+        // the neighbour may have reconnected on another reactor since, in
+        // which case it is passed on again
+        take_read_lock(&depotContents->neighbourLock);
+        if (entry.type == INBOX_TEXT) {
+            send_to_neighbour(depotContents, reactor, entry.neighbour, name);
+        } else {
+            send_goods_to_neighbour(depotContents, reactor, entry.neighbour,
+                    entry.quantity, name);
         }
+        release_rw_lock(&depotContents->neighbourLock);
     }
+    free(inbox);
 }
 
-// A function to store deferred messages
-// depotContents gives current state of depot and message is the recieved
-// info from another depot
-void defer_message(DepotContents *depotContents, char *message) {
-    int key = check_valid_number(message, 1);
-    if (key < 0) {
-        return;
+// Stop every other reactor at the end of its current pass of the event
+// loop, and wait until they have all stopped. reactor is the one asking
+void pause_reactors(DepotContents *depotContents, Reactor *reactor) {
+    pthread_mutex_lock(&depotContents->pauseLock);
+    // wait for the last pause to have finished everywhere
+    while (depotContents->numPaused > 0) {
+        pthread_cond_wait(&depotContents->pauseChanged, 
+                &depotContents->pauseLock);
     }
-    while (message[0] != ':') {
-        message++;
-    }    
-    message++;
-    bool newKey = true;
-    int keyIndex = 0;
-    for (int i = 0; i < depotContents->numDeferredMessages; i++) {
-        if (depotContents->deferredMessages[i].key == key) {
-            newKey = false;
-            keyIndex = i;
-            break;
+    __atomic_store_n(&depotContents->pauseRequested, true, 
+            __ATOMIC_RELEASE);
+    for (int i = 0; i < depotContents->numReactors; i++) {
+        uint64_t one = 1;
+        if (i != reactor->index) {
+            write(depotContents->reactors[i].inboxFd, &one, sizeof(one));
         }
     }
-    take_lock(&depotContents->lock);
-    if (newKey) {       
-        depotContents->numDeferredMessages++;
-        if (depotContents->numDeferredMessages == depotContents->
-                allocatedDeferredMessages) {
-            depotContents->allocatedDeferredMessages += 10;
-            depotContents->deferredMessages = 
-                    realloc(depotContents->deferredMessages, 
-                    depotContents->allocatedDeferredMessages * sizeof(char *));
-        }
-        int messageIndex = depotContents->numDeferredMessages - 1;
-        depotContents->deferredMessages[messageIndex].allocatedMessages = 10; 
-        depotContents->deferredMessages[messageIndex].messages = malloc(10 *
-                sizeof(char *));
-        depotContents->deferredMessages[messageIndex].currentIndex = 0;
-        depotContents->deferredMessages[messageIndex].messages[0] = message;
-        depotContents->deferredMessages[messageIndex].key = key;
-        depotContents->deferredMessages[messageIndex].numMessages = 1;
-    } else {
-        if (depotContents->deferredMessages[keyIndex].numMessages + 1 == 
-                depotContents->deferredMessages[keyIndex].allocatedMessages) {
-            depotContents->deferredMessages[keyIndex].allocatedMessages += 10;
-            depotContents->deferredMessages[keyIndex].messages = realloc(
-                    depotContents->deferredMessages[keyIndex].messages,
-                    depotContents->deferredMessages[keyIndex].allocatedMessages
-                    * sizeof(char *));
-        }
-        depotContents->deferredMessages[keyIndex].messages[depotContents->
-                deferredMessages[keyIndex].numMessages++] = message;
+    while (depotContents->numPaused < depotContents->numReactors - 1) {
+        pthread_cond_wait(&depotContents->pauseChanged, 
+                &depotContents->pauseLock);
     }
-    release_lock(&depotContents->lock); 
+    pthread_mutex_unlock(&depotContents->pauseLock);
 }
 
-// Function to execute a message
-// depotContents gives current state of depot and message is the recieved
-// info from another depot
-void execute_message(DepotContents *depotContents, char *message) {
-    int key = check_valid_number(message, 0);
-    if (key < 0) {
-        return;
-    } 
-    for (int i = 0; i < depotContents->numDeferredMessages; i++) {
-        if (depotContents->deferredMessages[i].key == key) {
-            // we have found the deferredMessage to execute
-            if (depotContents->deferredMessages[i].numMessages == 
-                    depotContents->deferredMessages[i].currentIndex) {
-                return;            
-            }  
-            for (int j = depotContents->deferredMessages[i].currentIndex; 
-                    j < depotContents->deferredMessages[i].numMessages; j++) {
-                interpret_message(depotContents, 
-                        depotContents->deferredMessages[i].messages[j], false);
-            }
-            take_lock(&depotContents->lock);
-            depotContents->deferredMessages[i].currentIndex += 
-                    depotContents->deferredMessages[i].numMessages - 
-                    depotContents->deferredMessages[i].currentIndex;
-            release_lock(&depotContents->lock);
+// Let the reactors stopped by pause_reactors carry on
+void resume_reactors(DepotContents *depotContents) {
+    pthread_mutex_lock(&depotContents->pauseLock);
+    __atomic_store_n(&depotContents->pauseRequested, false, 
+            __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&depotContents->pauseChanged);
+    pthread_mutex_unlock(&depotContents->pauseLock);
+}
+
+// Wait while the reactors are paused. Called by every reactor but the 
+// one which asked when it sees a pause has been asked for
+void wait_while_paused(DepotContents *depotContents) {
+    pthread_mutex_lock(&depotContents->pauseLock);
+    depotContents->numPaused++;
+    pthread_cond_broadcast(&depotContents->pauseChanged);
+    while (depotContents->pauseRequested) {
+        pthread_cond_wait(&depotContents->pauseChanged, 
+                &depotContents->pauseLock);
+    }
+    depotContents->numPaused--;
+    pthread_cond_broadcast(&depotContents->pauseChanged);
+    pthread_mutex_unlock(&depotContents->pauseLock);
+}
+
+// Put the given file descriptor into non-blocking mode
+// fd is the descriptor to change
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Accept every pending connection on a listening socket
+// depotContents gives the current state of the depot, reactor is the 
+// reactor which will own them and serverFd is the listening socket
+void accept_connections(DepotContents *depotContents, Reactor *reactor,
+        int serverFd) {
+    int connFd;
+    while (connFd = accept(serverFd, 0, 0), connFd >= 0) {
+        add_connection(depotContents, reactor, connFd, false);
+    }
+}
+
+// Create a connection for the given socket and add it to a reactor
+// depotContents gives current state of the depot, reactor is the reactor
+// which will own it, fd is the connected socket and messageSent tells us
+// if we have already sent our IM message
+// Return the new connection
+Connection *add_connection(DepotContents *depotContents, Reactor *reactor,
+        int fd, bool messageSent) {
+    set_nonblocking(fd);
+    Connection *connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->initial = true;
+    connection->messageSent = messageSent;
+    connection->neighbour = -1;
+    connection->reactor = reactor;
+    connection->dirtyList = &reactor->dirtyConnections;
+    connection->messageTokens = depotContents->peerMessages;
+    connection->byteTokens = depotContents->peerBytes;
+    connection->tokensAt = current_micros();
+    capture_event(depotContents, CAPTURE_OPEN, connection, NULL, 0);
+
+    take_lock(&depotContents->lock);
+    if (depotContents->numConnections == depotContents->allocatedConnections) {
+        depotContents->allocatedConnections += 10;
+        depotContents->connections = realloc(depotContents->connections,
+                depotContents->allocatedConnections * sizeof(Connection *));
+    }
+    depotContents->connections[depotContents->numConnections++] = connection;
+    release_lock(&depotContents->lock);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = connection;
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, fd, &event);
+    return connection;
+}
+
+// Close a connection and forget about it. Any neighbour using this 
+// connection is kept but can no longer be sent to
+// depotContents gives current state of the depot and connection is the
+// connection we are closing
+void close_connection(DepotContents *depotContents, Connection *connection) {
+    close(connection->fd);
+    capture_event(depotContents, CAPTURE_CLOSE, connection, NULL, 0);
+    if (connection->neighbour != -1) {
+        take_write_lock(&depotContents->neighbourLock);
+        depotContents->neighbourConnections[connection->neighbour] = NULL;
+        lose_routes(depotContents, connection->reactor, 
+                connection->neighbour);
+        if (connection->mirror) {
+            remove_mirror(depotContents, connection->neighbour);
+        }
+        release_rw_lock(&depotContents->neighbourLock);
+    }
+    take_lock(&depotContents->lock);
+    for (int i = 0; i < depotContents->numConnections; i++) {
+        if (depotContents->connections[i] == connection) {
+            depotContents->connections[i] = depotContents->
+                    connections[--depotContents->numConnections];
             break;
         }
     }
+    release_lock(&depotContents->lock);
+    // a connection we made is made again, unless it has failed too often
+    if (connection->connectPort != 0) {
+        retry_connect(depotContents, connection->reactor, 
+                connection->connectPort);
+    }
+    if (connection->dirty) {
+        Connection **link = connection->dirtyList;
+        while (*link != connection) {
+            link = &(*link)->nextDirty;
+        }
+        *link = connection->nextDirty;
+    }
+    if (connection->throttled) {
+        Connection **link = &connection->reactor->throttledConnections;
+        while (*link != connection) {
+            link = &(*link)->nextThrottled;
+        }
+        *link = connection->nextThrottled;
+    }
+    while (connection->outputHead != NULL) {
+        OutputChunk *chunk = connection->outputHead;
+        connection->outputHead = chunk->next;
+        free(chunk);
+    }
+    free(connection->readBuffer);
+    free(connection->scratch);
+    free(connection->peerGoods);
+    free(connection->sentGoods);
+    free(connection);
 }
 
-// add a given neighbour to the list of known ports
-// depotContents gives current state of depot and message is the recieved
-// info from another depot
-void add_neighbour(DepotContents *depotContents, char *message) {
-    int port = check_valid_number(message, 1);
-    take_lock(&depotContents->lock);
-    if (port < 0 || !new_port(depotContents, port)) {
-        release_lock(&depotContents->lock);
+// Handle an event the event loop reported for a connection
+// depotContents gives current state of the depot, connection is the
+// connection the event is for and events is the epoll event mask
+void handle_event(DepotContents *depotContents, Connection *connection,
+        uint32_t events) {
+    if (connection->connecting) {
+        // the connect has finished, one way or the other
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            close_connection(depotContents, connection);
+            return;
+        }
+        connection->connecting = false;
+    }
+    if (events & EPOLLOUT) {
+        handle_output(depotContents, connection);
+    } else if (!connection->readPaused && !connection->throttled &&
+            (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        if (!read_from_stream(depotContents, connection)) {
+            close_connection(depotContents, connection);
+        }
+    }
+}
+
+// Send a connection's queued output, then read from it if there is 
+// anything to read and it isn't being held back by unsent output
+// depotContents gives current state of the depot and connection is the
+// connection to send and read on
+void handle_output(DepotContents *depotContents, Connection *connection) {
+    flush_connection(connection);
+    if (connection->readPaused && connection->queuedBytes > LOW_WATER) {
         return;
     }
-    while (message[0] != ':') {
-        message++;
-    }    
-    message++; 
-    depotContents->numNeighbours++;
-    if (depotContents->numNeighbours == depotContents->allocatedNeighbours) {
-        depotContents->allocatedNeighbours += 10;
-        depotContents->neighbours = realloc(depotContents->neighbours, 
-                depotContents->allocatedNeighbours * sizeof(char *));
-        depotContents->neighbourPorts = realloc(depotContents->neighbourPorts,
-                depotContents->allocatedNeighbours * sizeof(int));
+    // input may have arrived while we weren't reading, and there won't be
+    // another event for it, so always try, unless the connection is held
+    // back by its limits, when its reactor tries it later
+    connection->readPaused = false;
+    if (connection->throttled) {
+        return;
     }
-    depotContents->neighbours[depotContents->numNeighbours - 1] = message;
-    depotContents->neighbourPorts[depotContents->numNeighbours - 1] = port;
-        
-    //send IM back
-    if (!depotContents->messageSent[get_tid(depotContents)]) {
-        fprintf(depotContents->wstream[get_tid(depotContents)], "IM:%d:%s\n", 
-                depotContents->port, depotContents->name);
-        fflush(depotContents->wstream[get_tid(depotContents)]);
+    if (!read_from_stream(depotContents, connection)) {
+        close_connection(depotContents, connection);
     }
-    release_lock(&depotContents->lock);
 }
 
-// We have recieved a CONNECT message and must try to connect to new depot
-// depotContents gives current state of depot and message is the recieved
-// info from another depot
-void connect_depots(DepotContents *depotContents, char *message) {
-    //client code -> try and connect to server and wait for IM message    
-    const char *port = message;
-    int numPort = check_valid_number(message, 0);
-    take_lock(&depotContents->lock);
-    if (numPort < 0 || !new_port(depotContents, numPort)) {
-        release_lock(&depotContents->lock);
+// Send the output of every connection which has had output queued since
+// the last time, so many messages go out in a single system call
+// reactor is the reactor whose connections we are sending on
+void flush_dirty(Reactor *reactor) {
+    while (reactor->dirtyConnections != NULL) {
+        Connection *connection = reactor->dirtyConnections;
+        reactor->dirtyConnections = connection->nextDirty;
+        connection->dirty = false;
+        flush_connection(connection);
+        if (connection->readPaused && connection->queuedBytes <= LOW_WATER) {
+            // reading here could queue more output without end, so have
+            // epoll report the connection again and read it then
+            rearm_connection(connection);
+        }
+    }
+}
+
+// Modify a connection's registration so epoll reports it again, as it
+// is writable, and it gets read then
+// connection is the connection to report again
+void rearm_connection(Connection *connection) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = connection;
+    epoll_ctl(connection->reactor->epollFd, EPOLL_CTL_MOD, connection->fd, 
+            &event);
+}
+
+// Queue a formatted message to be sent down a connection. It is sent 
+// once the event loop has finished handling the current events. Once the
+// connection has switched to the binary protocol the message is wrapped 
+// in a text frame. connection is where the message is going, or NULL if
+// there is no one to reply to, and format is a printf style format 
+// string, for a single line, followed by its arguments
+void send_message(Connection *connection, const char *format, ...) {
+    if (connection == NULL) {
+        // scheduled Executes run with no connection, so replies are dropped
         return;
     }
-    release_lock(&depotContents->lock);
+    char *message = scratch_buffer(connection, MIN_SCRATCH);
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, connection->scratchAllocated, format, 
+            args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if ((size_t)length >= connection->scratchAllocated) {
+        message = scratch_buffer(connection, length + 1);
+        va_start(args, format);
+        vsnprintf(message, length + 1, format, args);
+        va_end(args);
+    }
+    if (connection->binaryOut) {
+        // frames carry their own length so the newline isn't needed
+        if (length > 0 && message[length - 1] == '\n') {
+            length--;
+        }
+        send_frame(connection, OP_TEXT, (unsigned char *)message, length);
+    } else {
+        queue_output(connection, message, length);
+        mark_dirty(connection);
+    }
+}
+
+// Return a connection's scratch buffer, grown to at least the given size
+// Anything already in it is lost when it grows. connection is the 
+// connection whose buffer it is and size is how many bytes are needed
+char *scratch_buffer(Connection *connection, size_t size) {
+    if (connection->scratchAllocated < size) {
+        free(connection->scratch);
+        connection->scratchAllocated = size < MIN_SCRATCH ? MIN_SCRATCH : 
+                size;
+        connection->scratch = malloc(connection->scratchAllocated);
+        if (connection->scratch == NULL) {
+            //memory failure
+            exit(99);
+        }
+    }
+    return connection->scratch;
+}
+
+// Add bytes to the end of a connection's output without sending them
+// connection is where the bytes are going, data is the bytes and length
+// is how many there are
+void queue_output(Connection *connection, const void *data, size_t length) {
+    const char *bytes = data;
+    // only this reactor changes the counters, but the stats may be read
+    // from any, so they are stored atomically
+    __atomic_store_n(&connection->queuedBytes, 
+            connection->queuedBytes + length, __ATOMIC_RELAXED);
+    while (length > 0) {
+        OutputChunk *tail = connection->outputTail;
+        if (tail == NULL || tail->length == OUTPUT_CHUNK) {
+            OutputChunk *chunk = malloc(sizeof(OutputChunk));
+            chunk->next = NULL;
+            chunk->start = 0;
+            chunk->length = 0;
+            if (tail == NULL) {
+                connection->outputHead = chunk;
+            } else {
+                tail->next = chunk;
+            }
+            connection->outputTail = tail = chunk;
+        }
+        size_t space = OUTPUT_CHUNK - tail->length;
+        size_t amount = length < space ? length : space;
+        memcpy(tail->data + tail->length, bytes, amount);
+        tail->length += amount;
+        bytes += amount;
+        length -= amount;
+    }
+}
 
-    struct addrinfo *ai = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;        // IPv6  for generic could use AF_UNSPEC
-    hints.ai_socktype = SOCK_STREAM;
-    int err;
-    if ((err = getaddrinfo("127.0.0.1", port, &hints, &ai))) {
-        freeaddrinfo(ai);
-        return;   // could not work out the address
+// Add a connection to the list of connections with output to send
+// connection is the connection with new output
+void mark_dirty(Connection *connection) {
+    if (!connection->dirty) {
+        connection->dirty = true;
+        connection->nextDirty = *connection->dirtyList;
+        *connection->dirtyList = connection;
     }
+}
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
-    if (connect(fd, (struct sockaddr *)ai->ai_addr, sizeof(struct sockaddr))) {
+// Send as much of a connection's queued output as the socket will take,
+// gathering many blocks into each send. Anything left over is sent when 
+// the event loop reports the socket is writable again
+// connection is the connection to flush
+void flush_connection(Connection *connection) {
+    // output queued while connecting is sent once the connect finishes
+    if (connection->connecting) {
         return;
     }
-    // fd is now connected
-    // we want separate streams (which we can close independently)
-    take_lock(&depotContents->lock);
-    int fdDup = dup(fd);
-    depotContents->rstream[depotContents->numConnections] = fdopen(fd, "r");
-    depotContents->wstream[depotContents->numConnections] = fdopen(fdDup, "w");
-    depotContents->messageSent[depotContents->numConnections] = true;
-    fprintf(depotContents->wstream[depotContents->numConnections], 
-            "IM:%d:%s\n", depotContents->port, depotContents->name);
-    fflush(depotContents->wstream[depotContents->numConnections]);
-    
-    depotContents->numConnections++;
-    release_lock(&depotContents->lock);
-    pthread_create(&depotContents->tid[depotContents->numConnections - 1],
-            NULL, handle_connection, (void *)depotContents);
+    while (connection->outputHead != NULL) {
+        struct iovec iov[MAX_IOV];
+        int numIov = 0;
+        for (OutputChunk *chunk = connection->outputHead; 
+                chunk != NULL && numIov < MAX_IOV; chunk = chunk->next) {
+            iov[numIov].iov_base = chunk->data + chunk->start;
+            iov[numIov++].iov_len = chunk->length - chunk->start;
+        }
+        struct msghdr header;
+        memset(&header, 0, sizeof(struct msghdr));
+        header.msg_iov = iov;
+        header.msg_iovlen = numIov;
+        ssize_t count = sendmsg(connection->fd, &header, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // peer has gone, the read side will close the connection
+                count = connection->queuedBytes;
+            } else {
+                return;
+            }
+        }
+        __atomic_store_n(&connection->queuedBytes, 
+                connection->queuedBytes - count, __ATOMIC_RELAXED);
+        __atomic_store_n(&connection->bytesOut, 
+                connection->bytesOut + count, __ATOMIC_RELAXED);
+        // free every block which has been completely sent
+        while (count > 0) {
+            OutputChunk *chunk = connection->outputHead;
+            size_t remaining = chunk->length - chunk->start;
+            if ((size_t)count < remaining) {
+                chunk->start += count;
+                break;
+            }
+            count -= remaining;
+            connection->outputHead = chunk->next;
+            free(chunk);
+        }
+        if (connection->outputHead == NULL) {
+            connection->outputTail = NULL;
+        }
+    }
 }
 
-// Transfer given goods from 1 depot to another
-// depotContents is struct storing current depotContents
-// Message contains goods, quantity and location to be transferred to in format
-// of quantity:goods:location
-void transfer(DepotContents *depotContents, char *message) {
-    char *info = malloc(strlen(message) * sizeof(message));
-    int index = 0;
-    int counter = 0;
-    while (counter < 2) {       
-        if (message[index] == ':') {
-            counter++;
-        }
-        info[index] = message[index]; 
-        index++;     
-    }
-    // check valid number
-    int quantity = check_valid_number(info, 1);
+// Write value to out as a varint (7 bits per byte, low bits first, top bit
+// set on every byte but the last). Return the number of bytes written
+size_t put_varint(unsigned char *out, unsigned int value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+}
+
+// Read a varint starting at *pos, which is moved past it. end is the end
+// of the available bytes and value is set to the number read
+// Return 1 on success, 0 if more bytes are needed and -1 if it is invalid
+int get_varint(unsigned char **pos, unsigned char *end, unsigned int *value) {
+    unsigned int result = 0;
+    for (int i = 0; i < MAX_VARINT; i++) {
+        if (*pos + i >= end) {
+            return 0;
+        }
+        result |= (unsigned int)((*pos)[i] & 0x7f) << (7 * i);
+        if (!((*pos)[i] & 0x80)) {
+            *pos += i + 1;
+            *value = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+// Queue a binary frame to be sent
+// connection is where the frame is going, opcode is the type of frame and
+// payload is its body, which is length bytes long
+void send_frame(Connection *connection, unsigned char opcode, 
+        const unsigned char *payload, size_t length) {
+    unsigned char header[MAX_VARINT + 1];
+    size_t headerLength = put_varint(header, length + 1);
+    header[headerLength++] = opcode;
+    queue_output(connection, header, headerLength);
+    queue_output(connection, payload, length);
+    mark_dirty(connection);
+}
+
+// Return the id of the given good, or -1 if the depot has never seen it
+// name is the good we are looking for
+int good_id(DepotContents *depotContents, char *name) {
+    take_read_lock(&depotContents->goodsLock);
+    int index = good_at_depot(depotContents, name, hash_name(name));
+    int id = index == -1 ? -1 : depotContents->goods[index].id;
+    release_rw_lock(&depotContents->goodsLock);
+    return id;
+}
+
+// Tell a peer to deliver or withdraw goods. Binary connections name the
+// good by its id, which is defined for the peer the first time it is used
+// connection is where the message is going, type is 1 for Deliver and -1
+// for Withdraw, quantity is how many and name is the good
+void send_goods(DepotContents *depotContents, Connection *connection, 
+        int type, int quantity, char *name) {
+    const char *command = type == 1 ? "Deliver" : "Withdraw";
+    int id = connection->binaryOut ? good_id(depotContents, name) : -1;
+    if (id < 0) {
+        send_message(connection, "%s:%d:%s\n", command, quantity, name);
+        return;
+    }
+    size_t nameLength = strlen(name);
+    unsigned char *payload = (unsigned char *)scratch_buffer(connection, 
+            2 * MAX_VARINT + nameLength);
+    if ((size_t)id >= connection->allocatedSentGoods) {
+        size_t oldSize = connection->allocatedSentGoods;
+        connection->allocatedSentGoods = 2 * id + 16;
+        connection->sentGoods = realloc(connection->sentGoods, 
+                connection->allocatedSentGoods * sizeof(bool));
+        memset(connection->sentGoods + oldSize, 0, 
+                (connection->allocatedSentGoods - oldSize) * sizeof(bool));
+    }
+    if (!connection->sentGoods[id]) {
+        connection->sentGoods[id] = true;
+        size_t length = put_varint(payload, id);
+        memcpy(payload + length, name, nameLength);
+        send_frame(connection, OP_GOOD, payload, length + nameLength);
+    }
+    size_t length = put_varint(payload, quantity);
+    length += put_varint(payload + length, id);
+    send_frame(connection, type == 1 ? OP_DELIVER : OP_WITHDRAW, payload, 
+            length);
+}
+
+// Handle a Protocol message. "binary" means the peer can read binary 
+// frames, so we say we are switching and send frames from then on. 
+// "switch" means everything after this message from the peer is frames
+// connection is where the message came from and message is the rest of it
+void negotiate_protocol(Connection *connection, char *message) {
+    if (!strcmp(message, "binary") && !connection->binaryOut) {
+        send_message(connection, "Protocol:switch\n");
+        connection->binaryOut = true;
+    } else if (!strcmp(message, "switch")) {
+        connection->binaryIn = true;
+    }
+}
+
+// Interpret the text line starting at line if it has fully arrived
+// A line which has gone past messageLimit without ending marks the 
+// connection broken, so one peer can't make us buffer without limit
+// scanFrom is where to start looking for the end of the line and end is
+// the end of the bytes read so far
+// Return the start of the next message, or NULL if the line is incomplete
+// or the connection is broken
+char *read_line(DepotContents *depotContents, Connection *connection,
+        char *line, char *scanFrom, char *end) {
+    char *newline = memchr(scanFrom, '\n', end - scanFrom);
+    if (newline == NULL) {
+        if ((size_t)(end - line) > depotContents->messageLimit) {
+            connection->broken = true;
+        }
+        return NULL;
+    }
+    *newline = '\0';
+    bool initial = connection->initial;
+    connection->initial = false;
+    interpret_message(depotContents, connection, line, initial);
+    return newline + 1;
+}
+
+// Interpret the binary frame starting at start if it has fully arrived
+// A frame whose length can't be read or is over MAX_FRAME leaves us no
+// way to find the next one, so the connection is marked broken
+// end is the end of the bytes read so far
+// Return the start of the next message, or NULL if the frame is 
+// incomplete or the connection is broken
+char *read_frame(DepotContents *depotContents, Connection *connection,
+        char *start, char *end) {
+    unsigned char *pos = (unsigned char *)start;
+    unsigned int length;
+    int result = get_varint(&pos, (unsigned char *)end, &length);
+    if (result == 0) {
+        return NULL;
+    }
+    if (result < 0 || length > MAX_FRAME) {
+        connection->broken = true;
+        return NULL;
+    }
+    if (length > (size_t)((unsigned char *)end - pos)) {
+        return NULL;
+    }
+    if (length > 0) {
+        interpret_frame(depotContents, connection, pos[0], pos + 1, 
+                pos + length);
+    }
+    return (char *)pos + length;
+}
+
+// Interpret a complete binary frame
+// opcode is the type of frame and payload up to end is its body
+void interpret_frame(DepotContents *depotContents, Connection *connection,
+        unsigned char opcode, unsigned char *payload, unsigned char *end) {
+    if (opcode == OP_TEXT) {
+        // there is always a spare byte after the data in the read buffer
+        char saved = *end;
+        *end = '\0';
+        interpret_message(depotContents, connection, (char *)payload, false);
+        *end = saved;
+        return;
+    }
+    unsigned int first, second;
+    if (get_varint(&payload, end, &first) != 1) {
+        return;
+    }
+    if (opcode == OP_GOOD) {
+        // there is always a spare byte after the data in the read buffer
+        char saved = *end;
+        *end = '\0';
+        char *name = (char *)payload;
+        if (strlen(name) != (size_t)(end - payload) || !valid_name(name) ||
+                first >= MAX_PEER_GOODS) {
+            *end = saved;
+            return;
+        }
+        if (first >= connection->allocatedPeerGoods) {
+            size_t oldSize = connection->allocatedPeerGoods;
+            size_t newSize = 2 * first + 16;
+            int *peerGoods = realloc(connection->peerGoods, 
+                    newSize * sizeof(int));
+            if (peerGoods == NULL) {
+                // the frame is dropped, and its good can't be used
+                *end = saved;
+                return;
+            }
+            memset(peerGoods + oldSize, -1, 
+                    (newSize - oldSize) * sizeof(int));
+            connection->peerGoods = peerGoods;
+            connection->allocatedPeerGoods = newSize;
+        }
+        // the good is added now, so its frames can use our id for it
+        connection->peerGoods[first] = intern_good(depotContents, name);
+        *end = saved;
+    } else if (opcode == OP_DELIVER || opcode == OP_WITHDRAW) {
+        if (get_varint(&payload, end, &second) != 1 || first > INT_MAX ||
+                second >= connection->allocatedPeerGoods ||
+                connection->peerGoods[second] == -1) {
+            return;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        add_goods_by_id(depotContents, connection->peerGoods[second], 
+                opcode == OP_DELIVER ? (int)first : -(int)first);
+        record_message(opcode == OP_DELIVER ? TYPE_DELIVER : TYPE_WITHDRAW,
+                &start);
+    }
+}
+
+// Read whatever has arrived on a connection and interpret every complete
+// message. Reading stops early if the peer has too much output queued or
+// has gone over its limits, or for now if the connection has had its 
+// share of this pass
+// depotContents gives current state of depot and connection is the 
+// connection we wish to read from
+// Return false once the connection has been closed by the other end, or 
+// is broken
+bool read_from_stream(DepotContents *depotContents, Connection *connection) {
+    int reads = 0;
+    while (process_input(depotContents, connection)) {
+        if (reads++ == READ_BUDGET) {
+            // give the reactor's other connections a turn
+            rearm_connection(connection);
+            return true;
+        }
+        if (connection->readAllocated - connection->readLength < READ_CHUNK) {
+            connection->readAllocated = 2 * connection->readAllocated + 
+                    READ_CHUNK;
+            connection->readBuffer = realloc(connection->readBuffer,
+                    connection->readAllocated * sizeof(char));
+        }
+        // leave a spare byte at the end so frames can be terminated
+        size_t space = connection->readAllocated - connection->readLength - 1;
+        if (depotContents->peerBytes > 0) {
+            // read no more than the connection has tokens for
+            if (connection->byteTokens < 1) {
+                refill_tokens(depotContents, connection);
+            }
+            if (connection->byteTokens < 1) {
+                throttle_connection(connection);
+                return true;
+            }
+            if (space > connection->byteTokens) {
+                space = connection->byteTokens;
+            }
+        }
+        ssize_t count = read(connection->fd, 
+                connection->readBuffer + connection->readLength, space);
+        if (count == 0) {
+            return false;
+        }
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        capture_event(connection->reactor->depotContents, CAPTURE_READ,
+                connection, connection->readBuffer + connection->readLength,
+                count);
+        connection->readLength += count;
+        connection->byteTokens -= count;
+        __atomic_store_n(&connection->bytesIn, connection->bytesIn + count,
+                __ATOMIC_RELAXED);
+    }
+    return !connection->broken;
+}
+
+// Interpret every complete message in a connection's read buffer. These 
+// are lines of text, or binary frames once the peer has switched to the 
+// binary protocol. Messages are handed over in place, so anything which 
+// keeps part of a message must copy it
+// depotContents gives current state of depot and connection is the 
+// connection whose input we are handling
+// Return false if reading has been paused because the peer has too much
+// output queued, held back because it has gone over its limits, or the
+// connection is broken
+bool process_input(DepotContents *depotContents, Connection *connection) {
+    if (connection->broken) {
+        return false;
+    }
+    if (connection->readLength == 0) {
+        return !connection->readPaused && !connection->throttled;
+    }
+    char *buffer = connection->readBuffer;
+    char *end = buffer + connection->readLength;
+    // no line ending has been seen before scanFrom
+    char *scanFrom = buffer + connection->readScanned;
+    char *message = buffer;
+    connection->readScanned = 0;
+    while (message < end) {
+        // stop reading from a peer which isn't taking its output
+        if (connection->queuedBytes > HIGH_WATER) {
+            connection->readPaused = true;
+            break;
+        }
+        // and hold back one which has gone over its limits
+        if (!admit_message(depotContents, connection)) {
+            throttle_connection(connection);
+            break;
+        }
+        char *next;
+        if (connection->binaryIn) {
+            next = read_frame(depotContents, connection, message, end);
+        } else {
+            next = read_line(depotContents, connection, message, 
+                    scanFrom, end);
+        }
+        if (next == NULL) {
+            connection->readScanned = end - message;
+            break;
+        }
+        connection->messageTokens--;
+        message = scanFrom = next;
+    }
+    // keep anything not yet interpreted at the front of the buffer
+    connection->readLength = end - message;
+    memmove(buffer, message, connection->readLength);
+    return !connection->readPaused && !connection->throttled && 
+            !connection->broken;
+}
+
+// Check a connection's next message against the limits on what it may 
+// send. It must wait if the connection has used up its messages for now
+// Return true if it can be interpreted now
+bool admit_message(DepotContents *depotContents, Connection *connection) {
+    if (depotContents->peerMessages > 0 && connection->messageTokens < 1) {
+        refill_tokens(depotContents, connection);
+        if (connection->messageTokens < 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Top up a connection's tokens for the time since they were last topped 
+// up, to no more than a second's worth
+void refill_tokens(DepotContents *depotContents, Connection *connection) {
+    long now = current_micros();
+    double seconds = (now - connection->tokensAt) / 1000000.0;
+    connection->tokensAt = now;
+    connection->messageTokens += seconds * depotContents->peerMessages;
+    if (connection->messageTokens > depotContents->peerMessages) {
+        connection->messageTokens = depotContents->peerMessages;
+    }
+    connection->byteTokens += seconds * depotContents->peerBytes;
+    if (connection->byteTokens > depotContents->peerBytes) {
+        connection->byteTokens = depotContents->peerBytes;
+    }
+}
+
+// Stop reading from a connection until its reactor tries it again. What
+// it has sent stays in the socket, so the peer is slowed down rather than
+// anything being lost. connection is the connection to hold back
+void throttle_connection(Connection *connection) {
+    if (connection->throttled) {
+        return;
+    }
+    connection->throttled = true;
+    connection->nextThrottled = connection->reactor->throttledConnections;
+    connection->reactor->throttledConnections = connection;
+}
+
+// Try again to read from every connection the reactor has held back which
+// has tokens again. One which is still over its limits is held back 
+// again
+// depotContents gives the current state of the depot and reactor is the
+// reactor whose connections we are trying
+void check_throttled(DepotContents *depotContents, Reactor *reactor) {
+    Connection *connection = reactor->throttledConnections;
+    reactor->throttledConnections = NULL;
+    while (connection != NULL) {
+        Connection *next = connection->nextThrottled;
+        refill_tokens(depotContents, connection);
+        if ((depotContents->peerMessages > 0 && 
+                connection->messageTokens < 1) ||
+                (depotContents->peerBytes > 0 && 
+                connection->byteTokens < 1)) {
+            connection->nextThrottled = reactor->throttledConnections;
+            reactor->throttledConnections = connection;
+        } else {
+            connection->throttled = false;
+            // one waiting for its output to drain is read once it has
+            if (!connection->readPaused && 
+                    !read_from_stream(depotContents, connection)) {
+                close_connection(depotContents, connection);
+            }
+        }
+        connection = next;
+    }
+}
+
+// Return how many milliseconds the event loop can wait before it tries
+// its held back connections again, or -1 if it has none
+int throttle_wait(Reactor *reactor) {
+    return reactor->throttledConnections == NULL ? -1 : THROTTLE_TICK;
+}
+
+// Interpret a given message and record how long it took in the stats
+// depotContent gives current state, connection is where the message came
+// from, message is the message we are interpretting and initial tells us
+// if this is the first message from a new connection
+void interpret_message(DepotContents *depotContents, Connection *connection,
+        char *message, bool initial) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    MessageType type = dispatch_message(depotContents, connection, message,
+            initial);
+    record_message(type, &start);
+}
+
+// Send a given message to currect function. Arguments are as for
+// interpret_message. Return the type of message it was
+// A scheduled Execute runs its messages with no connection, so messages
+// which are answered or only make sense from a neighbour are ignored
+MessageType dispatch_message(DepotContents *depotContents, 
+        Connection *connection, char *message, bool initial) {
+    if (initial && strncmp(message, "IM:", 3)) {   
+        return TYPE_IGNORED;
+    }    
+    bool sender = connection != NULL;
+    if (!strncmp(message, "Connect:", 8)) { 
+        message += 8;
+        connect_depots(depotContents, message);
+        return TYPE_CONNECT;
+    } else if (!strncmp(message, "IM:", 3)) {        
+        if (!initial) {
+            return TYPE_IGNORED;
+        }
+        message += 3;
+        add_neighbour(depotContents, connection, message);
+        return TYPE_IM;
+    } else if (!strncmp(message, "Deliver:", 8)) {
+        message += 8;
+        move_items(depotContents, message, 1);
+        return TYPE_DELIVER;
+    } else if (!strncmp(message, "Withdraw:", 9)) {
+        message += 9;
+        move_items(depotContents, message, -1); 
+        return TYPE_WITHDRAW;
+    } else if (!strncmp(message, "Batch:", 6)) {
+        message += 6;
+        batch_items(depotContents, connection, message);
+        return TYPE_BATCH;
+    } else if (sender && !strncmp(message, "Protocol:", 9)) {
+        message += 9;
+        if (!strcmp(message, "binary")) {
+            depot_offered(depotContents, connection);
+        }
+        negotiate_protocol(connection, message);
+        return TYPE_PROTOCOL;
+    } else if (!strncmp(message, "Transfer:", 9)) {
+        message += 9;
+        transfer(depotContents, connection, message);
+        return TYPE_TRANSFER;
+    } else if (!strncmp(message, "Defer:", 6)) {
+        message += 6;
+        defer_message(depotContents, connection, message);
+        return TYPE_DEFER;
+    } else if (!strncmp(message, "ExecuteAt:", 10)) {
+        message += 10;
+        schedule_execute(depotContents, message, true);
+        return TYPE_SCHEDULE;
+    } else if (!strncmp(message, "ExecuteIn:", 10)) {
+        message += 10;
+        schedule_execute(depotContents, message, false);
+        return TYPE_SCHEDULE;
+    } else if (!strncmp(message, "Execute:", 8)) {
+        message += 8;
+        execute_message(depotContents, connection, message);
+        return TYPE_EXECUTE;
+    } else if (sender && !strcmp(message, "Stats:")) {
+        send_stats(depotContents, connection);
+        return TYPE_STATS;
+    } else if (sender && !strncmp(message, "Route:", 6)) {
+        message += 6;
+        route_message(depotContents, connection, message);
+        return TYPE_ROUTE;
+    } else if (!strncmp(message, "Forward:", 8)) {
+        message += 8;
+        forward_goods(depotContents, connection, message);
+        return TYPE_FORWARD;
+    } else if (sender && !strncmp(message, "Query:", 6)) {
+        message += 6;
+        start_query(depotContents, connection, message);
+        return TYPE_QUERY;
+    } else if (sender && !strncmp(message, "Probe:", 6)) {
+        message += 6;
+        probe_query(depotContents, connection, message);
+        return TYPE_PROBE;
+    } else if (sender && !strncmp(message, "Answer:", 7)) {
+        message += 7;
+        answer_query(depotContents, connection, message);
+        return TYPE_ANSWER;
+    } else if (!strncmp(message, "Follow:", 7)) {
+        message += 7;
+        follow_depot(depotContents, connection, message);
+        return TYPE_MIRROR;
+    } else if (sender && !strcmp(message, "Mirror:")) {
+        add_mirror(depotContents, connection);
+        return TYPE_MIRROR;
+    } else if (sender && !strncmp(message, "Resync:", 7)) {
+        message += 7;
+        mirror_goods(depotContents, connection, message, true);
+        return TYPE_MIRROR;
+    } else if (sender && !strncmp(message, "Update:", 7)) {
+        message += 7;
+        mirror_goods(depotContents, connection, message, false);
+        return TYPE_MIRROR;
+    }
+    return TYPE_IGNORED;
+} 
+
+// A function to handle moving items, type: 1 = addition, -1 = removal
+// depotContents gives current state of depot and message is the received
+// info from another depot
+void move_items(DepotContents *depotContents, char *message, int type) {
+    int quantity = check_valid_number(message, 1);
     if (quantity < 0) {
         return;
     }
-    message += index;
-    info[index - 1] = '\0';
-    take_lock(&depotContents->lock);
+    if (quantity != -1) {
+        while (message[0] != ':') {
+            message++;
+        }
+        //check valid name of good
+        message++;
+        if (valid_name(message)) {
+            if (type == 1) {
+                // Deliver
+                add_goods(depotContents, message, quantity);
+            } else if (type == -1) {
+                // Withdraw
+                add_goods(depotContents, message, 0 - quantity);  
+            }
+        }
+    }
+}
 
-    for (int i = 0; i < depotContents->numNeighbours; i++) {
-        if (!strcmp(message, depotContents->neighbours[i])) {
-            release_lock(&depotContents->lock);
-            move_items(depotContents, info, -1);
-            char *send = malloc(strlen(info) * sizeof(char));
-            strcpy(send, info);
-            send[index - 1] = '\n';
-            send[index] = '\0';
-            take_lock(&depotContents->lock);
-            fprintf(depotContents->wstream[i], "Deliver:%s", send);
-            fflush(depotContents->wstream[i]);
+// Handle a Batch message, which moves many goods at once in the format
+// Deliver:qty:good{:qty:good} or Withdraw:qty:good{:qty:good}
+// Nothing is moved unless every item in the batch is valid
+// depotContents gives current state of depot, connection is where it came
+// from and message is the received info from another depot, which is 
+// split up in place
+void batch_items(DepotContents *depotContents, Connection *connection, 
+        char *message) {
+    int type;
+    if (!strncmp(message, "Deliver:", 8)) {
+        type = 1;
+        message += 8;
+    } else if (!strncmp(message, "Withdraw:", 9)) {
+        type = -1;
+        message += 9;
+    } else {
+        return;
+    }
+    // every item has two fields, so there can be at most this many items
+    int maxItems = 1;
+    for (int i = 0; message[i] != '\0'; i++) {
+        if (message[i] == ':') {
+            maxItems++;
         }
     }
+    BatchItem *items = (BatchItem *)scratch_buffer(connection, 
+            (maxItems / 2 + 1) * sizeof(BatchItem));
+    int numItems = 0;
+    char *field = message;
+    while (field != NULL) {
+        char *name = strchr(field, ':');
+        if (name == NULL) {
+            return;
+        }
+        *name++ = '\0';
+        char *next = strchr(name, ':');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        int quantity = check_valid_number(field, 0);
+        if (quantity < 0 || !valid_name(name)) {
+            return;
+        }
+        items[numItems].name = name;
+        items[numItems].hash = hash_name(name);
+        items[numItems++].quantity = type * quantity;
+        field = next;
+    }
+    add_goods_batch(depotContents, items, numItems);
+}
+
+// Find the neighbour on the given port. Return its index, or -1 if the 
+// port is new. depotContents gives current state of depot and port is the
+// port which we are checking
+int find_port(DepotContents *depotContents, int port) {
+    size_t mask = depotContents->allocatedIndex - 1;
+    for (size_t i = hash_key(port) & mask; depotContents->portIndex[i] != -1;
+            i = (i + 1) & mask) {
+        if (depotContents->neighbourPorts[depotContents->portIndex[i]] == 
+                port) {
+            return depotContents->portIndex[i];
+        }
+    }
+    return -1;
+}
+
+// Find the first neighbour with the given name. Others with the same name
+// follow it in nextSameName. Return its index, or -1 if there isn't one
+// name is the neighbour we are looking for
+int find_neighbour(DepotContents *depotContents, char *name) {
+    size_t mask = depotContents->allocatedIndex - 1;
+    for (size_t i = hash_name(name) & mask; 
+            depotContents->nameIndex[i] != -1; i = (i + 1) & mask) {
+        int index = depotContents->nameIndex[i];
+        if (!strcmp(name, depotContents->neighbours[index])) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Add a neighbour to the name and port indexes. The neighbour lock must be
+// held for writing. index is the neighbour we are adding
+void index_neighbour(DepotContents *depotContents, int index) {
+    size_t mask = depotContents->allocatedIndex - 1;
+    size_t slot = hash_name(depotContents->neighbours[index]) & mask;
+    depotContents->nextSameName[index] = -1;
+    while (depotContents->nameIndex[slot] != -1) {
+        int other = depotContents->nameIndex[slot];
+        if (!strcmp(depotContents->neighbours[index], 
+                depotContents->neighbours[other])) {
+            // chain it after the first neighbour with this name
+            depotContents->nextSameName[index] = 
+                    depotContents->nextSameName[other];
+            depotContents->nextSameName[other] = index;
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (depotContents->nameIndex[slot] == -1) {
+        depotContents->nameIndex[slot] = index;
+    }
+    slot = hash_key(depotContents->neighbourPorts[index]) & mask;
+    while (depotContents->portIndex[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    depotContents->portIndex[slot] = index;
+}
+
+// Double the size of the neighbour indexes and add every neighbour to 
+// them again. The neighbour lock must be held for writing
+void grow_neighbour_index(DepotContents *depotContents) {
+    depotContents->allocatedIndex *= 2;
+    size_t size = depotContents->allocatedIndex * sizeof(int);
+    free(depotContents->nameIndex);
+    free(depotContents->portIndex);
+    depotContents->nameIndex = malloc(size);
+    depotContents->portIndex = malloc(size);
+    memset(depotContents->nameIndex, -1, size);
+    memset(depotContents->portIndex, -1, size);
+    for (int i = 0; i < depotContents->numNeighbours; i++) {
+        index_neighbour(depotContents, i);
+    }
+}
+
+// Hash a deferred message key. key is the key we are hashing
+unsigned int hash_key(int key) {
+    unsigned int hash = (unsigned int)key * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+// Find the slot in the deferred message table for the given key. If create
+// is true a slot is made for a new key, otherwise NULL is returned for keys
+// we haven't seen. The lock must be held by the caller
+DeferredMessage *find_key(DepotContents *depotContents, int key, 
+        bool create) {
+    if (create && 2 * (depotContents->numDeferredMessages + 1) > 
+            depotContents->allocatedDeferredMessages) {
+        grow_deferred(depotContents);
+    }
+    size_t mask = depotContents->allocatedDeferredMessages - 1;
+    size_t slot = hash_key(key) & mask;
+    DeferredMessage *deferred = &depotContents->deferredMessages[slot];
+    while (deferred->key != NO_KEY) {
+        if (deferred->key == key) {
+            return deferred;
+        }
+        slot = (slot + 1) & mask;
+        deferred = &depotContents->deferredMessages[slot];
+    }
+    if (!create) {
+        return NULL;
+    }
+    memset(deferred, 0, sizeof(DeferredMessage));
+    deferred->key = key;
+    depotContents->numDeferredMessages++;
+    return deferred;
+}
+
+// Double the size of the deferred message table and rehash every key 
+// into it. The lock must be held by the caller
+void grow_deferred(DepotContents *depotContents) {
+    size_t oldSize = depotContents->allocatedDeferredMessages;
+    DeferredMessage *oldTable = depotContents->deferredMessages;
+    size_t mask = oldSize * 2 - 1;
+    DeferredMessage *table = malloc(oldSize * 2 * sizeof(DeferredMessage));
+    if (table == NULL) {
+        //memory failure
+        exit(99);
+    }
+    for (size_t i = 0; i < oldSize * 2; i++) {
+        table[i].key = NO_KEY;
+    }
+    for (size_t i = 0; i < oldSize; i++) {
+        if (oldTable[i].key == NO_KEY) {
+            continue;
+        }
+        size_t slot = hash_key(oldTable[i].key) & mask;
+        while (table[slot].key != NO_KEY) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = oldTable[i];
+    }
+    depotContents->deferredMessages = table;
+    depotContents->allocatedDeferredMessages = oldSize * 2;
+    free(oldTable);
+}
+
+// A function to store deferred messages. Once deferred messages are using
+// all the room they have, the message is refused and the sender is told
+// with Full:key, rather than holding back a sender whose own Execute may
+// be what would make room
+// depotContents gives current state of depot, connection is where it came
+// from and message is the recieved info from another depot
+void defer_message(DepotContents *depotContents, Connection *connection, 
+        char *message) {
+    int key = check_valid_number(message, 1);
+    if (key < 0) {
+        return;
+    }
+    while (message[0] != ':') {
+        message++;
+    }    
+    message++;
+    size_t length = strlen(message);
+    if (!store_deferred(depotContents, key, message, length, 
+            depotContents->deferLimit)) {
+        send_message(connection, "Full:%d\n", key);
+    }
+}
+
+// Add a message to those waiting for the given key, and parse it ready
+// for when it is executed. It is journalled while the lock is held, so 
+// the journal has Defers and Executes of a key in the order the table 
+// saw them. Room for it is checked for under the lock too, so Defers
+// arriving together can't all fit into the same room
+// key is the key, message is the message, length is its length and limit
+// is the most bytes deferred messages may use, or 0 if there is no limit
+// Return false if there wasn't room for it
+bool store_deferred(DepotContents *depotContents, int key, char *message,
+        size_t length, size_t limit) {
+    take_lock(&depotContents->lock);
+    if (limit > 0 && depotContents->deferredBytes + length + 1 > limit) {
+        release_lock(&depotContents->lock);
+        return false;
+    }
+    log_defer(depotContents, key, message, length);
+    DeferredMessage *deferred = find_key(depotContents, key, true);
+    if (deferred->arenaLength + length + 1 > deferred->arenaAllocated) {
+        size_t size = deferred->arenaAllocated ? 
+                2 * deferred->arenaAllocated : MIN_ARENA;
+        while (size < deferred->arenaLength + length + 1) {
+            size *= 2;
+        }
+        deferred->arena = realloc(deferred->arena, size);
+        deferred->arenaAllocated = size;
+    }
+    size_t offset = deferred->arenaLength;
+    memcpy(deferred->arena + offset, message, length);
+    deferred->arena[offset + length] = '\0';
+    deferred->arenaLength += length + 1;
+    deferred->numMessages++;
+    __atomic_store_n(&depotContents->deferredBytes, 
+            depotContents->deferredBytes + length + 1, __ATOMIC_RELAXED);
+    compile_deferred(depotContents, deferred, offset);
+    touch_key(depotContents, deferred);
+    __atomic_fetch_add(&threadStats->deferredDepth, 1, __ATOMIC_RELAXED);
+    release_lock(&depotContents->lock); 
+    return true;
+}
+
+// Parse the deferred message at offset in a key's arena into operations.
+// Deliveries, withdrawals, batches and transfers of valid goods become
+// goods operations. Their goods are only looked up, so a Defer never 
+// changes the goods table; goods it hasn't seen are added when the key is
+// executed. Invalid ones are dropped, as they would do nothing. Any other
+// message is kept to be interpreted when it runs. The lock must be held
+// by the caller. deferred is the key's slot in the table
+void compile_deferred(DepotContents *depotContents, 
+        DeferredMessage *deferred, size_t offset) {
+    // the arena is what the journal and snapshots keep, so the message
+    // is split up in a copy
+    char *message = strdup(deferred->arena + offset);
+    if (message == NULL) {
+        //memory failure
+        exit(99);
+    }
+    if (!strncmp(message, "Deliver:", 8)) {
+        compile_move(depotContents, deferred, message + 8, offset + 8, 1);
+    } else if (!strncmp(message, "Withdraw:", 9)) {
+        compile_move(depotContents, deferred, message + 9, offset + 9, -1);
+    } else if (!strncmp(message, "Batch:Deliver:", 14)) {
+        compile_items(depotContents, deferred, message + 14, offset + 14, 
+                1);
+    } else if (!strncmp(message, "Batch:Withdraw:", 15)) {
+        compile_items(depotContents, deferred, message + 15, offset + 15, 
+                -1);
+    } else if (!strncmp(message, "Transfer:", 9)) {
+        char *quantity = message + 9;
+        char *name = strchr(quantity, ':');
+        char *location = name == NULL ? NULL : strchr(name + 1, ':');
+        if (location != NULL && check_valid_number(quantity, 1) >= 0) {
+            *location++ = '\0';
+            name++;
+            DeferredOp *op = add_deferred_op(deferred, valid_name(name) ?
+                    DEFER_TRANSFER : DEFER_MESSAGE);
+            if (op->kind == DEFER_TRANSFER) {
+                op->good = good_id(depotContents, name);
+                op->name = offset + (name - message);
+                op->quantity = check_valid_number(quantity, 1);
+                op->text = offset + (location - message);
+            } else {
+                op->text = offset;
+            }
+        }
+    } else {
+        add_deferred_op(deferred, DEFER_MESSAGE)->text = offset;
+    }
+    free(message);
+}
+
+// Parse a deferred Deliver or Withdraw, in the format qty:good, into a 
+// goods operation. It is checked just as move_items checks one which 
+// isn't deferred, and dropped if it is invalid. deferred is the key's 
+// slot in the table, item is the message after its command, start is 
+// where item starts in the arena and sign is 1 for deliveries and -1 for
+// withdrawals
+void compile_move(DepotContents *depotContents, DeferredMessage *deferred,
+        char *item, size_t start, int sign) {
+    int quantity = check_valid_number(item, 1);
+    if (quantity < 0) {
+        return;
+    }
+    char *name = strchr(item, ':') + 1;
+    if (!valid_name(name)) {
+        return;
+    }
+    DeferredOp *op = add_deferred_op(deferred, DEFER_GOODS);
+    op->good = good_id(depotContents, name);
+    op->name = start + (name - item);
+    op->quantity = sign * quantity;
+}
+
+// Parse the items of a deferred Batch, in the format qty:good{:qty:good},
+// into goods operations. As with a Batch, nothing is added unless every 
+// item is valid. deferred is the key's slot in the table, items is the 
+// message after its command, which is split up in place, start is where
+// items starts in the arena and sign is 1 for deliveries and -1 for 
+// withdrawals. Return false if the items were invalid
+bool compile_items(DepotContents *depotContents, DeferredMessage *deferred,
+        char *items, size_t start, int sign) {
+    int numItems = 0;
+    for (char *field = items; field != NULL; numItems++) {
+        char *name = strchr(field, ':');
+        if (name == NULL) {
+            return false;
+        }
+        *name++ = '\0';
+        char *next = strchr(name, ':');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (check_valid_number(field, 0) < 0 || !valid_name(name)) {
+            return false;
+        }
+        field = next;
+    }
+    char *field = items;
+    for (int i = 0; i < numItems; i++) {
+        char *name = field + strlen(field) + 1;
+        DeferredOp *op = add_deferred_op(deferred, DEFER_GOODS);
+        op->good = good_id(depotContents, name);
+        op->name = start + (name - items);
+        op->quantity = sign * check_valid_number(field, 0);
+        field = name + strlen(name) + 1;
+    }
+    return true;
+}
+
+// Add an operation of the given kind to a key's deferred operations
+// deferred is the key's slot in the table. Return the operation
+DeferredOp *add_deferred_op(DeferredMessage *deferred, int kind) {
+    if ((size_t)deferred->numOps == deferred->allocatedOps) {
+        deferred->allocatedOps = deferred->allocatedOps ? 
+                2 * deferred->allocatedOps : MIN_DEFERRED_OPS;
+        deferred->ops = realloc(deferred->ops, 
+                deferred->allocatedOps * sizeof(DeferredOp));
+        if (deferred->ops == NULL) {
+            //memory failure
+            exit(99);
+        }
+    }
+    DeferredOp *op = &deferred->ops[deferred->numOps++];
+    memset(op, 0, sizeof(DeferredOp));
+    op->kind = kind;
+    return op;
+}
+
+// Function to execute a message
+// depotContents gives current state of depot, connection is where the
+// message came from and message is the recieved info from another depot
+void execute_message(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int key = check_valid_number(message, 0);
+    if (key < 0) {
+        return;
+    } 
+    execute_key(depotContents, connection, key);
+}
+
+// Execute the messages waiting for the given key
+// The key's messages are taken out of the table before they are run, so
+// anything they defer waits for the next Execute. Their goods operations
+// are applied together, so no one sees some of them done and not others,
+// then any other messages are interpreted in the order they were deferred
+// connection is where the messages are treated as coming from, or NULL 
+// for a scheduled Execute, whose replies go nowhere
+void execute_key(DepotContents *depotContents, Connection *connection, 
+        int key) {
+    DeferredMessage taken;
+    if (!take_deferred(depotContents, key, &taken)) {
+        return;
+    }
+
+    apply_deferred(depotContents, message_reactor(depotContents, 
+            connection), &taken);
+    for (int i = 0; i < taken.numOps; i++) {
+        if (taken.ops[i].kind == DEFER_MESSAGE) {
+            interpret_message(depotContents, connection, 
+                    taken.arena + taken.ops[i].text, false);
+        }
+    }
+    free(taken.arena);
+    free(taken.ops);
+}
+
+// Return the reactor handling a message. connection is where it came 
+// from, or NULL for a scheduled Execute, which the first reactor runs
+Reactor *message_reactor(DepotContents *depotContents, 
+        Connection *connection) {
+    return connection == NULL ? &depotContents->reactors[0] : 
+            connection->reactor;
+}
+
+// Take the messages waiting for the given key out of the table, and 
+// journal that they were executed while the lock is held
+// key is the key and taken is set to its slot as it was, whose arena and
+// ops the caller must free. Return false if there are no messages
+bool take_deferred(DepotContents *depotContents, int key, 
+        DeferredMessage *taken) {
+    take_lock(&depotContents->lock);
+    DeferredMessage *deferred = find_key(depotContents, key, false);
+    if (deferred == NULL || deferred->numMessages == 0) {
+        release_lock(&depotContents->lock);
+        return false;
+    }
+    log_execute(depotContents, key);
+    *taken = *deferred;
+    touch_key(depotContents, deferred);
+    __atomic_store_n(&depotContents->deferredBytes, 
+            depotContents->deferredBytes - taken->arenaLength, 
+            __ATOMIC_RELAXED);
+    deferred->arena = NULL;
+    deferred->arenaLength = 0;
+    deferred->arenaAllocated = 0;
+    deferred->numMessages = 0;
+    deferred->ops = NULL;
+    deferred->numOps = 0;
+    deferred->allocatedOps = 0;
+    __atomic_fetch_sub(&threadStats->deferredDepth, taken->numMessages, 
+            __ATOMIC_RELAXED);
+    release_lock(&depotContents->lock);
+    return true;
+}
+
+// Handle an ExecuteAt or ExecuteIn message, in the format key:time, which
+// schedules the key's messages to be executed. For ExecuteAt the time is
+// when, in milliseconds since the epoch, and for ExecuteIn it is how many
+// milliseconds from now. A time which has passed executes them as soon as
+// possible. message is the rest of the message and absolute is true for
+// ExecuteAt
+void schedule_execute(DepotContents *depotContents, char *message, 
+        bool absolute) {
+    int key = check_valid_number(message, 1);
+    if (key < 0) {
+        return;
+    }
+    long time = read_millis(strchr(message, ':') + 1);
+    if (time < 0) {
+        return;
+    }
+    long delay = absolute ? time - wall_millis() : time;
+    if (delay < 0) {
+        delay = 0;
+    } else if (delay > WHEEL_SPAN * TIMER_TICK) {
+        delay = WHEEL_SPAN * TIMER_TICK;
+    }
+    long due = current_millis() + delay;
+    take_lock(&depotContents->lock);
+    DeferredMessage *deferred = find_key(depotContents, key, true);
+    // the key mustn't expire before it is executed
+    if (due > deferred->heldUntil) {
+        deferred->heldUntil = due;
+    }
+    touch_key(depotContents, deferred);
+    add_timer(depotContents, TIMER_EXECUTE, key, due);
+    release_lock(&depotContents->lock);
+}
+
+// Return the number of milliseconds in input, which must be nothing but
+// digits, or -1 if it isn't valid
+long read_millis(char *input) {
+    if (input[0] < '0' || input[0] > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    long value = strtol(input, &end, 10);
+    if (*end != '\0' || errno == ERANGE) {
+        return -1;
+    }
+    return value;
+}
+
+// Return the time of day in milliseconds since the epoch
+long wall_millis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// Note that a deferred key has just been used, starting a timer to expire
+// it if it hasn't got one. The timer doesn't move when the key is used 
+// again, it just finds the key hasn't been idle long enough and is set 
+// again. The lock must be held by the caller. deferred is the key's slot
+void touch_key(DepotContents *depotContents, DeferredMessage *deferred) {
+    deferred->touched = current_millis();
+    if (!deferred->expiring) {
+        deferred->expiring = true;
+        add_timer(depotContents, TIMER_EXPIRE, deferred->key, 
+                deferred->touched + key_ttl(depotContents));
+    }
+}
+
+// Remove a key from the deferred message table, moving back any keys
+// after it which would otherwise no longer be found. The lock must be 
+// held by the caller. deferred is the key's slot, whose arena and ops
+// must already have been freed
+void remove_key(DepotContents *depotContents, DeferredMessage *deferred) {
+    DeferredMessage *table = depotContents->deferredMessages;
+    size_t mask = depotContents->allocatedDeferredMessages - 1;
+    size_t hole = deferred - table;
+    for (size_t slot = (hole + 1) & mask; table[slot].key != NO_KEY; 
+            slot = (slot + 1) & mask) {
+        size_t home = hash_key(table[slot].key) & mask;
+        // a key can fill the hole unless its probe starts after the hole
+        bool between = hole <= slot ? home > hole && home <= slot : 
+                home > hole || home <= slot;
+        if (!between) {
+            table[hole] = table[slot];
+            hole = slot;
+        }
+    }
+    table[hole].key = NO_KEY;
+    depotContents->numDeferredMessages--;
+}
+
+// Return how long in milliseconds a deferred key can go unused before it
+// expires
+long key_ttl(DepotContents *depotContents) {
+    return depotContents->deferTtl > 0 ? depotContents->deferTtl : 
+            DEFER_TTL;
+}
+
+// Remove a deferred key if it has been idle for the TTL, otherwise wait 
+// until it will have been. Messages still waiting for it are only dropped
+// if DEPOT_DEFER_TTL was given, otherwise the key is kept without a timer
+// until it is next used. key is the key whose timer is due
+void expire_key(DepotContents *depotContents, int key) {
+    take_lock(&depotContents->lock);
+    DeferredMessage *deferred = find_key(depotContents, key, false);
+    if (deferred == NULL) {
+        release_lock(&depotContents->lock);
+        return;
+    }
+    long idleUntil = (deferred->touched > deferred->heldUntil ? 
+            deferred->touched : deferred->heldUntil) + 
+            key_ttl(depotContents);
+    if (idleUntil > current_millis()) {
+        add_timer(depotContents, TIMER_EXPIRE, key, idleUntil);
+        release_lock(&depotContents->lock);
+        return;
+    }
+    if (deferred->numMessages > 0 && depotContents->deferTtl == 0) {
+        deferred->expiring = false;
+        release_lock(&depotContents->lock);
+        return;
+    }
+    if (deferred->numMessages > 0) {
+        // replaying an Execute drops the messages, which is all we do
+        log_execute(depotContents, key);
+        __atomic_fetch_sub(&threadStats->deferredDepth, 
+                deferred->numMessages, __ATOMIC_RELAXED);
+        __atomic_store_n(&depotContents->deferredBytes, 
+                depotContents->deferredBytes - deferred->arenaLength, 
+                __ATOMIC_RELAXED);
+    }
+    free(deferred->arena);
+    free(deferred->ops);
+    remove_key(depotContents, deferred);
     release_lock(&depotContents->lock);
 }
+
+// Start a timer. The first reactor is woken if it may be waiting for 
+// something later. type is what the timer does, key is the deferred key 
+// it is for and when is when it is due, in milliseconds on the monotonic
+// clock
+void add_timer(DepotContents *depotContents, int type, int key, 
+        long when) {
+    Timer *timer = malloc(sizeof(Timer));
+    if (timer == NULL) {
+        //memory failure
+        exit(99);
+    }
+    timer->type = type;
+    timer->key = key;
+    // round up, so it is never run early
+    timer->due = (when + TIMER_TICK - 1) / TIMER_TICK;
+    TimerWheel *wheel = &depotContents->timers;
+    pthread_mutex_lock(&wheel->lock);
+    bool wake = place_timer(wheel, timer) || wheel->numTimers == 0;
+    wheel->numTimers++;
+    pthread_mutex_unlock(&wheel->lock);
+    // before the depot is running timers are only added as it starts up
+    if (wake && depotContents->reactors != NULL) {
+        uint64_t one = 1;
+        write(depotContents->reactors[0].inboxFd, &one, sizeof(one));
+    }
+}
+
+// Put a timer in the wheel, in the lowest level which reaches as far as
+// it is due. The wheel's lock must be held by the caller
+// Return true if it went in the lowest level
+bool place_timer(TimerWheel *wheel, Timer *timer) {
+    if (timer->due < wheel->now) {
+        timer->due = wheel->now;
+    } else if (timer->due - wheel->now >= WHEEL_SPAN) {
+        timer->due = wheel->now + WHEEL_SPAN - 1;
+    }
+    long ahead = timer->due - wheel->now;
+    int level = 0;
+    while (ahead >= 1L << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (timer->due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    timer->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = timer;
+    return level == 0;
+}
+
+// Run every timer which is due. For each tick the slot of the lowest 
+// level is taken, after moving timers down from each level whose slot 
+// has come round, so a tick costs the same however many timers there are
+// Due timers are taken out under the wheel's lock and run after it is 
+// released
+void run_timers(DepotContents *depotContents) {
+    TimerWheel *wheel = &depotContents->timers;
+    long tick = current_millis() / TIMER_TICK;
+    Timer *due = NULL;
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->now <= tick && wheel->numTimers > 0) {
+        long now = wheel->now;
+        for (int level = 1; level < WHEEL_LEVELS && 
+                (now & ((1L << (WHEEL_BITS * level)) - 1)) == 0; level++) {
+            int slot = (now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            Timer *timer = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            while (timer != NULL) {
+                Timer *next = timer->next;
+                place_timer(wheel, timer);
+                timer = next;
+            }
+        }
+        Timer **slot = &wheel->slots[0][now & (WHEEL_SLOTS - 1)];
+        while (*slot != NULL) {
+            Timer *timer = *slot;
+            *slot = timer->next;
+            timer->next = due;
+            due = timer;
+            wheel->numTimers--;
+        }
+        wheel->now++;
+    }
+    if (wheel->numTimers == 0 && wheel->now <= tick) {
+        // nothing is waiting, so there is nothing to move on
+        wheel->now = tick + 1;
+    }
+    pthread_mutex_unlock(&wheel->lock);
+
+    while (due != NULL) {
+        Timer *timer = due;
+        due = timer->next;
+        if (timer->type == TIMER_EXECUTE) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            execute_key(depotContents, NULL, timer->key);
+            record_message(TYPE_EXECUTE, &start);
+        } else {
+            expire_key(depotContents, timer->key);
+        }
+        free(timer);
+    }
+}
+
+// Return how many milliseconds the first reactor can wait before it must
+// run timers, or -1 if there are none. That is until the next timer in 
+// the lowest level, or if there isn't one before the level goes round,
+// until a higher level moves its timers down
+int timer_wait(DepotContents *depotContents) {
+    TimerWheel *wheel = &depotContents->timers;
+    pthread_mutex_lock(&wheel->lock);
+    if (wheel->numTimers == 0) {
+        pthread_mutex_unlock(&wheel->lock);
+        return -1;
+    }
+    long next = wheel->now;
+    while (wheel->slots[0][next & (WHEEL_SLOTS - 1)] == NULL) {
+        if ((++next & (WHEEL_SLOTS - 1)) == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    long wait = next * TIMER_TICK - current_millis();
+    return wait < 0 ? 0 : wait;
+}
+
+// Apply the goods operations of executed messages as one change, under a
+// single hold of the goods lock and with one journal reservation. Goods
+// which weren't in the table when they were deferred are added first. 
+// Goods sent on by transfers are gathered while the neighbours are looked
+// up and sent once the goods lock is released, so each neighbour is sent
+// its deliveries together. reactor is the reactor we are running on and
+// taken is what was taken out of the deferred message table, whose arena
+// is ours to split up
+void apply_deferred(DepotContents *depotContents, Reactor *reactor, 
+        DeferredMessage *taken) {
+    DeferredSend *sends = NULL;
+    int numSends = 0;
+    size_t allocatedSends = 0;
+    size_t logLength = 0;
+    take_read_lock(&depotContents->neighbourLock);
+    take_write_lock(&depotContents->goodsLock);
+    for (int i = 0; i < taken->numOps; i++) {
+        DeferredOp *op = &taken->ops[i];
+        if (op->kind == DEFER_MESSAGE) {
+            continue;
+        }
+        if (op->good == -1) {
+            char *name = taken->arena + op->name;
+            name[strcspn(name, ":")] = '\0';
+            op->good = insert_good(depotContents, name, hash_name(name), 0);
+        }
+        char *name = deferred_good(depotContents, op)->name;
+        if (op->kind == DEFER_GOODS) {
+            logLength += MAX_LOG_RECORD + strlen(name);
+            continue;
+        }
+        char *destination = taken->arena + op->text;
+        int first = find_neighbour(depotContents, destination);
+        for (int j = first; j != -1; j = depotContents->nextSameName[j]) {
+            DeferredSend *send = add_deferred_send(&sends, &numSends, 
+                    &allocatedSends);
+            send->neighbour = j;
+            send->good = op->good;
+            send->quantity = op->quantity;
+            send->name = name;
+            send->destination = NULL;
+        }
+        // a depot further away is sent the goods along the route to it
+        int slot = first != -1 ? -1 : find_route(depotContents, 
+                destination, hash_name(destination));
+        if (slot != -1 && depotContents->routes[slot].nextHop != -1) {
+            DeferredSend *send = add_deferred_send(&sends, &numSends, 
+                    &allocatedSends);
+            send->neighbour = depotContents->routes[slot].nextHop;
+            send->good = op->good;
+            send->quantity = op->quantity;
+            send->name = name;
+            send->destination = destination;
+        }
+    }
+    for (int i = 0; i < numSends; i++) {
+        logLength += MAX_LOG_RECORD + strlen(sends[i].name);
+    }
+
+    unsigned char *record = NULL;
+    size_t used = 0;
+    if (depotContents->journal.enabled && logLength > 0) {
+        record = reserve_journal(&depotContents->journal, logLength);
+    }
+    for (int i = 0; i < taken->numOps; i++) {
+        DeferredOp *op = &taken->ops[i];
+        if (op->kind == DEFER_GOODS) {
+            Good *good = deferred_good(depotContents, op);
+            good->quantity += op->quantity;
+            note_change(depotContents, good);
+            if (record != NULL) {
+                used += put_goods_record(record + used, good->name, 
+                        op->quantity);
+            }
+        }
+    }
+    for (int i = 0; i < numSends; i++) {
+        Good *good = 
+                &depotContents->goods[depotContents->goodSlots[sends[i].good]];
+        good->quantity -= sends[i].quantity;
+        note_change(depotContents, good);
+        if (record != NULL) {
+            used += put_goods_record(record + used, sends[i].name, 
+                    -sends[i].quantity);
+        }
+    }
+    if (record != NULL) {
+        commit_journal(&depotContents->journal, used);
+    }
+    release_rw_lock(&depotContents->goodsLock);
+
+    qsort(sends, numSends, sizeof(DeferredSend), compare_sends);
+    send_deferred(depotContents, reactor, sends, numSends);
+    release_rw_lock(&depotContents->neighbourLock);
+    free(sends);
+}
+
+// Return the good a deferred goods operation or transfer is for, once it
+// has an id. The goods lock must be held by the caller
+Good *deferred_good(DepotContents *depotContents, DeferredOp *op) {
+    return &depotContents->goods[depotContents->goodSlots[op->good]];
+}
+
+// Add a send to the list gathered by executed transfers, which grows as
+// needed. sends is the list, numSends how many it holds and allocated how
+// many it has room for. Return the send, with its place in the order set
+DeferredSend *add_deferred_send(DeferredSend **sends, int *numSends, 
+        size_t *allocated) {
+    if ((size_t)*numSends == *allocated) {
+        *allocated = *allocated ? 2 * *allocated : MIN_DEFERRED_OPS;
+        *sends = realloc(*sends, *allocated * sizeof(DeferredSend));
+        if (*sends == NULL) {
+            //memory failure
+            exit(99);
+        }
+    }
+    DeferredSend *send = &(*sends)[*numSends];
+    send->order = (*numSends)++;
+    return send;
+}
+
+// Compare two sends by neighbour, keeping those to the same neighbour in
+// the order they were executed, for use with qsort
+// a and b are the DeferredSend pointers being compared
+int compare_sends(const void *a, const void *b) {
+    const DeferredSend *first = a;
+    const DeferredSend *second = b;
+    if (first->neighbour != second->neighbour) {
+        return first->neighbour < second->neighbour ? -1 : 1;
+    }
+    return first->order - second->order;
+}
+
+// Send the goods gathered by executed transfers. Each neighbour is sent
+// all its deliveries in one Batch (or as a plain Deliver if there is only
+// one), followed by the goods it is to forward. The neighbour lock must
+// be held by the caller. reactor is the reactor we are running on and 
+// sends, sorted by neighbour, has numSends entries
+void send_deferred(DepotContents *depotContents, Reactor *reactor, 
+        DeferredSend *sends, int numSends) {
+    int end;
+    for (int start = 0; start < numSends; start = end) {
+        int neighbour = sends[start].neighbour;
+        int numDeliveries = 0;
+        size_t length = sizeof("Batch:Deliver\n");
+        for (end = start; end < numSends && 
+                sends[end].neighbour == neighbour; end++) {
+            if (sends[end].destination == NULL) {
+                numDeliveries++;
+                length += strlen(sends[end].name) + 13;
+            }
+        }
+        char *line = NULL;
+        if (numDeliveries > 1) {
+            line = malloc(length);
+            size_t used = sprintf(line, "Batch:Deliver");
+            for (int i = start; i < end; i++) {
+                if (sends[i].destination == NULL) {
+                    used += sprintf(line + used, ":%d:%s", 
+                            sends[i].quantity, sends[i].name);
+                }
+            }
+            sprintf(line + used, "\n");
+            send_to_neighbour(depotContents, reactor, neighbour, line);
+            free(line);
+        }
+        for (int i = start; i < end; i++) {
+            if (sends[i].destination == NULL && numDeliveries == 1) {
+                send_goods_to_neighbour(depotContents, reactor, neighbour,
+                        sends[i].quantity, sends[i].name);
+            } else if (sends[i].destination != NULL) {
+                line = malloc(strlen(sends[i].name) + 
+                        strlen(sends[i].destination) + 32);
+                sprintf(line, "Forward:%d:%d:%s:%s\n", MAX_HOPS - 1, 
+                        sends[i].quantity, sends[i].name, 
+                        sends[i].destination);
+                send_to_neighbour(depotContents, reactor, neighbour, line);
+                free(line);
+            }
+        }
+    }
+}
+
+// add a given neighbour to the list of known ports
+// depotContents gives current state of depot, connection is the connection
+// the neighbour is on and message is the recieved info from another depot
+void add_neighbour(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int port = check_valid_number(message, 1);
+    take_write_lock(&depotContents->neighbourLock);
+    if (port < 0) {
+        release_rw_lock(&depotContents->neighbourLock);
+        return;
+    }
+    finish_connect(connection);
+    int known = find_port(depotContents, port);
+    if (known != -1 && depotContents->neighbourConnections[known] != NULL) {
+        release_rw_lock(&depotContents->neighbourLock);
+        return;
+    }
+    if (known != -1) {
+        // a neighbour we lost the connection to has come back
+        depotContents->neighbourConnections[known] = connection;
+        connection->neighbour = known;
+    } else {
+        add_new_neighbour(depotContents, connection, port, message);
+    }
+        
+    //send IM back. A connection we made is to a depot, so it is greeted
+    // now, otherwise we wait to see if the neighbour offers the binary 
+    // protocol, as only depots do
+    if (!connection->messageSent) {
+        connection->messageSent = true;
+        send_message(connection, "IM:%d:%s\n", depotContents->port, 
+                depotContents->name);
+    } else {
+        greet_depot(depotContents, connection);
+    }
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Handle a neighbour offering the binary protocol, which shows it is a 
+// depot rather than a client, by greeting it if it hasn't been already
+// connection is where the offer came from
+void depot_offered(DepotContents *depotContents, Connection *connection) {
+    take_write_lock(&depotContents->neighbourLock);
+    greet_depot(depotContents, connection);
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Start talking to a neighbour as a depot: offer it the binary protocol,
+// and exchange routes and queries with it from now on. Clients are never
+// greeted, so they only ever see the IM. The neighbour lock must be held 
+// for writing by the caller. connection is the neighbour's connection
+void greet_depot(DepotContents *depotContents, Connection *connection) {
+    if (connection->neighbour == -1 || connection->isDepot) {
+        return;
+    }
+    connection->isDepot = true;
+    send_message(connection, "Protocol:binary\n");
+    // the neighbour is a route of its own, and can use all of ours
+    learn_route(depotContents, connection->reactor, connection->neighbour,
+            depotContents->neighbours[connection->neighbour], 0);
+    send_routes(depotContents, connection);
+    // a depot we mirror is asked for all its goods each time it connects.
+    // It may have restarted, so its serials may start again
+    if (followed(depotContents, connection)) {
+        depotContents->followSerial = 0;
+        send_message(connection, "Mirror:\n");
+    }
+}
+
+// Add a neighbour we haven't seen before. The neighbour lock must be held
+// for writing. connection is the connection the neighbour is on, port is
+// its port and message is its IM from the port onwards
+void add_new_neighbour(DepotContents *depotContents, Connection *connection,
+        int port, char *message) {
+    while (message[0] != ':') {
+        message++;
+    }    
+    message++; 
+    if (depotContents->numNeighbours + 1 == 
+            depotContents->allocatedNeighbours) {
+        depotContents->allocatedNeighbours *= 2;
+        depotContents->neighbours = realloc(depotContents->neighbours, 
+                depotContents->allocatedNeighbours * sizeof(char *));
+        depotContents->neighbourPorts = realloc(depotContents->neighbourPorts,
+                depotContents->allocatedNeighbours * sizeof(int));
+        depotContents->neighbourConnections = realloc(
+                depotContents->neighbourConnections,
+                depotContents->allocatedNeighbours * sizeof(Connection *));
+        depotContents->nextSameName = realloc(depotContents->nextSameName,
+                depotContents->allocatedNeighbours * sizeof(int));
+    }
+    int index = depotContents->numNeighbours;
+    depotContents->neighbours[index] = strdup(message);
+    depotContents->neighbourPorts[index] = port;
+    depotContents->neighbourConnections[index] = connection;
+    connection->neighbour = index;
+    depotContents->numNeighbours++;
+    // keep the indexes at most half full
+    if (2 * depotContents->numNeighbours > depotContents->allocatedIndex) {
+        grow_neighbour_index(depotContents);
+    } else {
+        index_neighbour(depotContents, index);
+    }
+}
+
+// Find the route to the depot with the given name. Return its slot in the
+// route table, or -1 if there isn't one. hash is the hash of the name
+int find_route(DepotContents *depotContents, char *name, unsigned int hash) {
+    size_t mask = depotContents->allocatedRoutes - 1;
+    for (size_t i = hash & mask; depotContents->routes[i].name != NULL; 
+            i = (i + 1) & mask) {
+        if (depotContents->routes[i].hash == hash && 
+                !strcmp(name, depotContents->routes[i].name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Double the size of the route table and rehash every route into it
+// The neighbour lock must be held for writing by the caller
+void grow_routes(DepotContents *depotContents) {
+    size_t oldSize = depotContents->allocatedRoutes;
+    Route *oldRoutes = depotContents->routes;
+    size_t mask = oldSize * 2 - 1;
+    Route *routes = calloc(oldSize * 2, sizeof(Route));
+    if (routes == NULL) {
+        //memory failure
+        exit(99);
+    }
+    for (size_t i = 0; i < oldSize; i++) {
+        if (oldRoutes[i].name == NULL) {
+            continue;
+        }
+        size_t slot = oldRoutes[i].hash & mask;
+        while (routes[slot].name != NULL) {
+            slot = (slot + 1) & mask;
+        }
+        routes[slot] = oldRoutes[i];
+    }
+    depotContents->routes = routes;
+    depotContents->allocatedRoutes = oldSize * 2;
+    free(oldRoutes);
+}
+
+// Add an unreachable route to the depot with the given name, which must 
+// not have one yet. The neighbour lock must be held for writing by the 
+// caller. hash is the hash of the name. Return the new route
+Route *add_route(DepotContents *depotContents, char *name, 
+        unsigned int hash) {
+    // keep it at most half full
+    if (2 * (depotContents->numRoutes + 1) > depotContents->allocatedRoutes) {
+        grow_routes(depotContents);
+    }
+    size_t mask = depotContents->allocatedRoutes - 1;
+    size_t slot = hash & mask;
+    while (depotContents->routes[slot].name != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    Route *route = &depotContents->routes[slot];
+    route->name = intern_name(&depotContents->routeNames, name);
+    route->hash = hash;
+    route->distance = MAX_HOPS;
+    route->nextHop = -1;
+    depotContents->numRoutes++;
+    return route;
+}
+
+// Take in a neighbour's distance to a depot, as in the distance vector
+// algorithm. Our route is changed if this is shorter, or if it is through
+// this neighbour anyway, and any change is passed on to every neighbour
+// The neighbour lock must be held for writing by the caller
+// reactor is the reactor we are running on, neighbour is the neighbour 
+// it came from, name is the depot and distance is the neighbour's 
+// distance to it, MAX_HOPS if it can't reach it
+void learn_route(DepotContents *depotContents, Reactor *reactor, 
+        int neighbour, char *name, int distance) {
+    if (!strcmp(name, depotContents->name)) {
+        return;
+    }
+    distance = distance + 1 < MAX_HOPS ? distance + 1 : MAX_HOPS;
+    unsigned int hash = hash_name(name);
+    int slot = find_route(depotContents, name, hash);
+    if (slot == -1 && distance == MAX_HOPS) {
+        return;
+    }
+    Route *route = slot == -1 ? add_route(depotContents, name, hash) : 
+            &depotContents->routes[slot];
+    if (route->nextHop == neighbour ? route->distance != distance : 
+            distance < route->distance) {
+        route->distance = distance;
+        route->nextHop = distance == MAX_HOPS ? -1 : neighbour;
+        advertise_route(depotContents, reactor, route);
+    } else if (distance == MAX_HOPS && route->distance < MAX_HOPS) {
+        // the neighbour has lost its route, so tell it about ours, 
+        // rather than waiting for it to change
+        send_route(depotContents, reactor, neighbour, route->distance, 
+                route->name);
+    }
+}
+
+// Tell every depot neighbour about a route which has changed. The one the
+// route goes through is told it is unreachable, so it never routes back 
+// through us. The neighbour lock must be held by the caller. reactor is the 
+// reactor we are running on and route is the route which changed
+void advertise_route(DepotContents *depotContents, Reactor *reactor, 
+        Route *route) {
+    for (int i = 0; i < depotContents->numNeighbours; i++) {
+        Connection *connection = depotContents->neighbourConnections[i];
+        if (connection != NULL && connection->isDepot) {
+            send_route(depotContents, reactor, i, 
+                    i == route->nextHop ? MAX_HOPS : route->distance, 
+                    route->name);
+        }
+    }
+}
+
+// Tell a neighbour our distance to a depot. The neighbour lock must be 
+// held by the caller. reactor is the reactor we are running on, neighbour
+// is who to tell, distance is the distance and name is the depot
+void send_route(DepotContents *depotContents, Reactor *reactor, 
+        int neighbour, int distance, char *name) {
+    char *line = malloc(strlen(name) + 32);
+    sprintf(line, "Route:%d:%s\n", distance, name);
+    send_to_neighbour(depotContents, reactor, neighbour, line);
+    free(line);
+}
+
+// Send our route table to a neighbour which has just sent its IM, along
+// with our own name, so it can route through us. Routes through the 
+// neighbour itself are left out. The neighbour lock must be held by the 
+// caller. connection is the connection to the neighbour
+void send_routes(DepotContents *depotContents, Connection *connection) {
+    send_message(connection, "Route:0:%s\n", depotContents->name);
+    for (size_t i = 0; i < depotContents->allocatedRoutes; i++) {
+        Route *route = &depotContents->routes[i];
+        if (route->name != NULL && route->distance < MAX_HOPS && 
+                route->nextHop != connection->neighbour) {
+            send_message(connection, "Route:%d:%s\n", route->distance, 
+                    route->name);
+        }
+    }
+}
+
+// Make every route through a neighbour whose connection has closed 
+// unreachable, telling the other neighbours. The neighbour lock must be 
+// held for writing by the caller. reactor is the reactor we are running on
+// and neighbour is the neighbour which has gone
+void lose_routes(DepotContents *depotContents, Reactor *reactor, 
+        int neighbour) {
+    for (size_t i = 0; i < depotContents->allocatedRoutes; i++) {
+        Route *route = &depotContents->routes[i];
+        if (route->name != NULL && route->nextHop == neighbour) {
+            route->distance = MAX_HOPS;
+            route->nextHop = -1;
+            advertise_route(depotContents, reactor, route);
+        }
+    }
+}
+
+// Handle a Route message, in the format distance:depot, from a neighbour
+// connection is where it came from and message is the rest of it
+void route_message(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int distance = check_valid_number(message, 1);
+    if (distance < 0) {
+        return;
+    }
+    char *name = strchr(message, ':') + 1;
+    if (!valid_name(name) || connection->neighbour == -1) {
+        return;
+    }
+    take_write_lock(&depotContents->neighbourLock);
+    // routes only come from depots, which have been greeted by now
+    if (connection->isDepot) {
+        learn_route(depotContents, connection->reactor, 
+                connection->neighbour, name, 
+                distance < MAX_HOPS ? distance : MAX_HOPS);
+    }
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Send a line of text to a neighbour, if it is connected. Neighbours on 
+// other reactors are sent it by their own reactor. The neighbour lock must
+// be held by the caller. reactor is the reactor we are running on, 
+// neighbour is who to send to and line is the text, ending in a newline
+void send_to_neighbour(DepotContents *depotContents, Reactor *reactor, 
+        int neighbour, char *line) {
+    Connection *connection = depotContents->neighbourConnections[neighbour];
+    if (connection != NULL && connection->reactor == reactor) {
+        send_message(connection, "%s", line);
+    } else if (connection != NULL) {
+        InboxEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = INBOX_TEXT;
+        entry.neighbour = neighbour;
+        entry.length = strlen(line) + 1;
+        post_to_reactor(connection->reactor, &entry, line);
+    }
+}
+
+// Deliver goods to a neighbour, if it is connected. Neighbours on other 
+// reactors are sent them by their own reactor. The neighbour lock must be
+// held by the caller. reactor is the reactor we are running on, neighbour
+// is who to send to, quantity is how many and name is the good
+void send_goods_to_neighbour(DepotContents *depotContents, Reactor *reactor,
+        int neighbour, int quantity, char *name) {
+    Connection *connection = depotContents->neighbourConnections[neighbour];
+    if (connection != NULL && connection->reactor == reactor) {
+        send_goods(depotContents, connection, 1, quantity, name);
+    } else if (connection != NULL) {
+        InboxEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = INBOX_GOODS;
+        entry.neighbour = neighbour;
+        entry.quantity = quantity;
+        entry.length = strlen(name) + 1;
+        post_to_reactor(connection->reactor, &entry, name);
+    }
+}
+
+// We have recieved a CONNECT message and must try to connect to new depot
+// Connects are shared out between the reactors by port, so repeats of a 
+// Connect go to the same reactor. depotContents gives current state of 
+// depot and message is the recieved info from another depot
+void connect_depots(DepotContents *depotContents, char *message) {
+    int port = check_valid_number(message, 0);
+    if (port <= 0 || port > USHRT_MAX) {
+        return;
+    }
+    InboxEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = INBOX_CONNECT;
+    entry.port = port;
+    post_to_reactor(&depotContents->reactors[port % 
+            depotContents->numReactors], &entry, NULL);
+}
+
+// Start connecting to the given port, unless we are already connected or
+// connecting to it. The connect is started here and finished by the
+// event loop, so many Connects are made at once
+// depotContents gives current state of depot and reactor is the reactor
+// which will own the connection
+void connect_to_port(DepotContents *depotContents, Reactor *reactor, 
+        int port) {
+    if (find_pending(reactor, port) != -1) {
+        return;
+    }
+    take_read_lock(&depotContents->neighbourLock);
+    int known = find_port(depotContents, port);
+    bool connected = known != -1 && 
+            depotContents->neighbourConnections[known] != NULL;
+    release_rw_lock(&depotContents->neighbourLock);
+    if (connected) {
+        return;
+    }
+    start_connect(depotContents, reactor, add_pending(reactor, port));
+}
+
+// Add a pending connect to the given port, which hasn't been tried yet
+// reactor is the reactor which will make it
+PendingConnect *add_pending(Reactor *reactor, int port) {
+    if (reactor->numPendingConnects == 
+            (int)reactor->allocatedPendingConnects) {
+        reactor->allocatedPendingConnects = 
+                reactor->allocatedPendingConnects ? 
+                2 * reactor->allocatedPendingConnects : 16;
+        reactor->pendingConnects = realloc(reactor->pendingConnects, 
+                reactor->allocatedPendingConnects * sizeof(PendingConnect));
+    }
+    PendingConnect *pending = 
+            &reactor->pendingConnects[reactor->numPendingConnects++];
+    pending->port = port;
+    pending->attempts = 0;
+    pending->connection = NULL;
+    return pending;
+}
+
+// Return the current time in milliseconds
+long current_millis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+// Return the current time in microseconds
+long current_micros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+// Return the value of the environment variable name if it is a positive
+// number, otherwise return defaultValue
+int config_value(const char *name, int defaultValue) {
+    char *value = getenv(name);
+    if (value == NULL || check_valid_number(value, 0) <= 0) {
+        return defaultValue;
+    }
+    return check_valid_number(value, 0);
+}
+
+// Return the index of the reactor's pending connect to the given port, or
+// -1 if there isn't one
+int find_pending(Reactor *reactor, int port) {
+    for (int i = 0; i < reactor->numPendingConnects; i++) {
+        if (reactor->pendingConnects[i].port == port) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Start a non-blocking connect for a pending connect. Our IM is queued 
+// straight away and is sent as soon as the connect finishes
+void start_connect(DepotContents *depotContents, Reactor *reactor, 
+        PendingConnect *pending) {
+    pending->attempts++;
+    pending->deadline = current_millis() + depotContents->connectTimeout;
+    // a depot on this host is reached through its Unix domain socket if it
+    // has one, which skips the TCP stack
+    int fd = depotContents->reactors[0].localFd == -1 ? -1 : 
+            connect_local(pending->port);
+    if (fd == -1) {
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(pending->port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd == -1 || (connect(fd, (struct sockaddr *)&address, 
+                sizeof(address)) && errno != EINPROGRESS)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            retry_connect(depotContents, reactor, pending->port);
+            return;
+        }
+    }
+    Connection *connection = add_connection(depotContents, reactor, fd, 
+            true);
+    connection->connectPort = pending->port;
+    connection->connecting = true;
+    pending->connection = connection;
+    send_message(connection, "IM:%d:%s\nProtocol:binary\n", 
+            depotContents->port, depotContents->name);
+}
+
+// A connection has recieved its IM, so if we made it the connect is done
+void finish_connect(Connection *connection) {
+    Reactor *reactor = connection->reactor;
+    int index = connection->connectPort == 0 ? -1 : 
+            find_pending(reactor, connection->connectPort);
+    if (index != -1) {
+        reactor->pendingConnects[index] = 
+                reactor->pendingConnects[--reactor->numPendingConnects];
+    }
+}
+
+// A connect to the given port has failed, or a connection we made has 
+// closed. Wait to try again, backing off exponentially, unless it has
+// been tried too many times
+void retry_connect(DepotContents *depotContents, Reactor *reactor, 
+        int port) {
+    int index = find_pending(reactor, port);
+    if (index == -1) {
+        // the connection was working, so it gets a fresh set of attempts
+        add_pending(reactor, port);
+        index = reactor->numPendingConnects - 1;
+    }
+    PendingConnect *pending = &reactor->pendingConnects[index];
+    pending->connection = NULL;
+    if (pending->attempts >= depotContents->connectAttempts) {
+        *pending = reactor->pendingConnects[--reactor->numPendingConnects];
+        return;
+    }
+    long backoff = CONNECT_BACKOFF;
+    for (int i = 1; i < pending->attempts && backoff < MAX_BACKOFF; i++) {
+        backoff *= 2;
+    }
+    if (backoff > MAX_BACKOFF) {
+        backoff = MAX_BACKOFF;
+    }
+    pending->deadline = current_millis() + backoff;
+}
+
+// Time out connects which have taken too long and start those which have 
+// waited long enough to be retried
+void check_connects(DepotContents *depotContents, Reactor *reactor) {
+    if (reactor->numPendingConnects == 0) {
+        return;
+    }
+    long now = current_millis();
+    // go backwards, as connects which give up are swapped with the last
+    for (int i = reactor->numPendingConnects - 1; i >= 0; i--) {
+        PendingConnect *pending = &reactor->pendingConnects[i];
+        if (pending->deadline > now) {
+            continue;
+        }
+        if (pending->connection != NULL) {
+            // closing it sets up the retry
+            close_connection(depotContents, pending->connection);
+        } else {
+            start_connect(depotContents, reactor, pending);
+        }
+    }
+}
+
+// Return how many milliseconds the event loop can wait before a connect 
+// needs to be checked, or -1 if it can wait forever
+int connect_wait(Reactor *reactor) {
+    if (reactor->numPendingConnects == 0) {
+        return -1;
+    }
+    long deadline = reactor->pendingConnects[0].deadline;
+    for (int i = 1; i < reactor->numPendingConnects; i++) {
+        if (reactor->pendingConnects[i].deadline < deadline) {
+            deadline = reactor->pendingConnects[i].deadline;
+        }
+    }
+    long wait = deadline - current_millis();
+    return wait < 0 ? 0 : wait;
+}
+
+// Transfer given goods from 1 depot to another
+// depotContents is struct storing current depotContents, connection is 
+// where the message came from. Neighbours on other reactors are sent the
+// goods by their own reactor
+// Message contains goods, quantity and location to be transferred to in format
+// of quantity:goods:location
+void transfer(DepotContents *depotContents, Connection *connection, 
+        char *message) {
+    // the location follows the second colon
+    char *location = strchr(message, ':');
+    if (location != NULL) {
+        location = strchr(location + 1, ':');
+    }
+    if (location == NULL || check_valid_number(message, 1) < 0) {
+        return;
+    }
+    // split the message in place into quantity:goods and the location
+    *location = '\0';
+    // goods have their own lock, so stock updates can carry on while we
+    // hold the neighbour table for reading
+    Reactor *reactor = message_reactor(depotContents, connection);
+    take_read_lock(&depotContents->neighbourLock);
+
+    int quantity = check_valid_number(message, 1);
+    char *name = strchr(message, ':') + 1;
+    int first = find_neighbour(depotContents, location + 1);
+    for (int i = first; i != -1; i = depotContents->nextSameName[i]) {
+        move_items(depotContents, message, -1);
+        send_goods_to_neighbour(depotContents, reactor, i, quantity, 
+                name);
+    }
+    // a depot further away is sent the goods along the route to it
+    if (first == -1 && valid_name(name)) {
+        char *destination = location + 1;
+        int slot = find_route(depotContents, destination, 
+                hash_name(destination));
+        Route *route = slot == -1 ? NULL : &depotContents->routes[slot];
+        if (route != NULL && route->nextHop != -1) {
+            move_items(depotContents, message, -1);
+            char *line = malloc(strlen(message) + strlen(destination) + 32);
+            sprintf(line, "Forward:%d:%s:%s\n", MAX_HOPS - 1, message, 
+                    destination);
+            send_to_neighbour(depotContents, reactor, route->nextHop, 
+                    line);
+            free(line);
+        }
+    }
+    release_rw_lock(&depotContents->neighbourLock);
+    *location = ':';
+}
+
+// Pass on goods being sent to a depot which isn't a neighbour of the one 
+// they came from, in the format hops:quantity:goods:location. hops is how
+// many more times they may be passed on. They are delivered here if this
+// is the depot, else to the depot if it is a neighbour, else along the 
+// route to it. Nothing happens to this depot's own goods on the way
+// connection is where the message came from
+void forward_goods(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int hops = check_valid_number(message, 1);
+    char *rest = strchr(message, ':');
+    if (hops < 0 || rest == NULL || check_valid_number(++rest, 1) < 0) {
+        return;
+    }
+    int quantity = check_valid_number(rest, 1);
+    char *name = strchr(rest, ':') + 1;
+    char *location = strchr(name, ':');
+    if (location == NULL) {
+        return;
+    }
+    *location++ = '\0';
+    if (!valid_name(name) || !valid_name(location)) {
+        return;
+    }
+    if (!strcmp(location, depotContents->name)) {
+        add_goods(depotContents, name, quantity);
+        return;
+    }
+    Reactor *reactor = message_reactor(depotContents, connection);
+    take_read_lock(&depotContents->neighbourLock);
+    int neighbour = find_neighbour(depotContents, location);
+    int slot = find_route(depotContents, location, hash_name(location));
+    if (neighbour != -1) {
+        send_goods_to_neighbour(depotContents, reactor, neighbour, 
+                quantity, name);
+    } else if (hops > 0 && slot != -1 && 
+            depotContents->routes[slot].nextHop != -1) {
+        char *line = malloc(strlen(name) + strlen(location) + 48);
+        sprintf(line, "Forward:%d:%d:%s:%s\n", hops - 1, quantity, name,
+                location);
+        send_to_neighbour(depotContents, reactor, 
+                depotContents->routes[slot].nextHop, line);
+        free(line);
+    }
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Handle a Query message, in the format hops:good{:good}, which asks how
+// much of each good is held by every depot up to hops away. The reply is 
+// a Held:depot:good:quantity line for each depot holding any of a good, 
+// then a Total:good:quantity line for each good. A recent answer to the 
+// same question is sent back straight away, otherwise the query is passed
+// on to the neighbouring depots and answered once they have all answered
+// connection is where the message came from
+void start_query(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int hops = check_valid_number(message, 1);
+    if (hops < 0 || connection->neighbour == -1) {
+        return;
+    }
+    char *goods = strchr(message, ':') + 1;
+    if (!valid_goods(goods)) {
+        return;
+    }
+    char *key = query_key(hops, goods);
+    char *reply = cached_answer(depotContents, key);
+    free(key);
+    if (reply != NULL) {
+        send_message(connection, "%s", reply);
+        free(reply);
+        return;
+    }
+    take_read_lock(&depotContents->neighbourLock);
+    pthread_mutex_lock(&depotContents->queryLock);
+    Query *query = add_query(depotContents, depotContents->name, 
+            depotContents->nextSerial++, connection->neighbour, hops, goods);
+    query->local = true;
+    add_holdings(depotContents, query);
+    query->waiting = pass_on_query(depotContents, connection->reactor, query,
+            hops);
+    if (query->waiting == 0) {
+        finish_query(depotContents, connection->reactor, query);
+    }
+    pthread_mutex_unlock(&depotContents->queryLock);
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Handle a Probe message, which passes a query on from a neighbouring 
+// depot, in the format hops:serial:origin:good{:good}. A query seen before
+// is answered at once with nothing, so each depot is only counted once
+// connection is where the message came from
+void probe_query(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int hops = check_valid_number(message, 1);
+    char *field = strchr(message, ':');
+    if (hops < 0 || connection->neighbour == -1 || 
+            check_valid_number(field + 1, 1) < 0) {
+        return;
+    }
+    int serial = check_valid_number(field + 1, 1);
+    char *origin = strchr(field + 1, ':') + 1;
+    char *goods = strchr(origin, ':');
+    if (goods == NULL) {
+        return;
+    }
+    *goods++ = '\0';
+    if (!valid_name(origin) || !valid_goods(goods)) {
+        return;
+    }
+    take_read_lock(&depotContents->neighbourLock);
+    pthread_mutex_lock(&depotContents->queryLock);
+    if (!strcmp(origin, depotContents->name) || 
+            find_query(depotContents, origin, serial) != NULL) {
+        send_message(connection, "Answer:%d:%s\n", serial, origin);
+    } else {
+        Query *query = add_query(depotContents, origin, serial, 
+                connection->neighbour, hops, goods);
+        add_holdings(depotContents, query);
+        query->waiting = pass_on_query(depotContents, connection->reactor, 
+                query, hops);
+        if (query->waiting == 0) {
+            finish_query(depotContents, connection->reactor, query);
+        }
+    }
+    pthread_mutex_unlock(&depotContents->queryLock);
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Handle an Answer message, in the format serial:origin{:depot:good:qty},
+// from a depot a query was passed on to. The holdings it found are added
+// to the query's, and the query is answered if it was the last one 
+// waited for. connection is where the message came from
+void answer_query(DepotContents *depotContents, Connection *connection,
+        char *message) {
+    int serial = check_valid_number(message, 1);
+    if (serial < 0) {
+        return;
+    }
+    char *origin = strchr(message, ':') + 1;
+    char *entries = strchr(origin, ':');
+    if (entries != NULL) {
+        *entries = '\0';
+    }
+    take_read_lock(&depotContents->neighbourLock);
+    pthread_mutex_lock(&depotContents->queryLock);
+    Query *query = find_query(depotContents, origin, serial);
+    if (entries != NULL) {
+        *entries = ':';
+    }
+    if (query != NULL && !query->done) {
+        if (entries != NULL) {
+            append_entries(query, entries);
+        }
+        if (--query->waiting == 0) {
+            finish_query(depotContents, connection->reactor, query);
+        }
+    }
+    pthread_mutex_unlock(&depotContents->queryLock);
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Check a list of goods, separated by colons, has at least one good and 
+// that every good is a valid name. goods is the list
+bool valid_goods(char *goods) {
+    bool empty = true;
+    for (int i = 0; goods[i] != '\0'; i++) {
+        if (goods[i] == ':') {
+            if (empty) {
+                return false;
+            }
+            empty = true;
+        } else if (goods[i] == ' ' || goods[i] == '\n' || goods[i] == '\r') {
+            return false;
+        } else {
+            empty = false;
+        }
+    }
+    return !empty;
+}
+
+// Start keeping track of a query. The query lock must be held by the 
+// caller. origin and serial identify the query, parent is the neighbour
+// to answer, hops is how much further it may be passed on and goods is 
+// what it asks about. Return the new query
+Query *add_query(DepotContents *depotContents, char *origin, int serial,
+        int parent, int hops, char *goods) {
+    if (depotContents->numQueries == depotContents->allocatedQueries) {
+        depotContents->allocatedQueries = 
+                2 * depotContents->allocatedQueries + 16;
+        depotContents->queries = realloc(depotContents->queries, 
+                depotContents->allocatedQueries * sizeof(Query));
+    }
+    Query *query = &depotContents->queries[depotContents->numQueries];
+    memset(query, 0, sizeof(Query));
+    query->origin = strdup(origin);
+    query->serial = serial;
+    query->parent = parent;
+    query->hops = hops;
+    query->goods = strdup(goods);
+    query->deadline = current_millis() + depotContents->queryTimeout;
+    // check_queries looks at this without the lock
+    __atomic_store_n(&depotContents->numQueries, 
+            depotContents->numQueries + 1, __ATOMIC_RELEASE);
+    // the first reactor times queries out, and may be waiting with no
+    // timeout. Later queries never have an earlier deadline, so it only 
+    // needs waking for the first
+    if (depotContents->numQueries == 1) {
+        uint64_t one = 1;
+        write(depotContents->reactors[0].inboxFd, &one, sizeof(one));
+    }
+    return query;
+}
+
+// Find a query this depot has seen, or return NULL if there isn't one
+// The query lock must be held by the caller. origin and serial identify
+// the query
+Query *find_query(DepotContents *depotContents, char *origin, int serial) {
+    for (int i = 0; i < depotContents->numQueries; i++) {
+        Query *query = &depotContents->queries[i];
+        if (query->serial == serial && !strcmp(query->origin, origin)) {
+            return query;
+        }
+    }
+    return NULL;
+}
+
+// Add this depot's holdings of each good a query asks about to its 
+// answer. The query lock must be held by the caller
+void add_holdings(DepotContents *depotContents, Query *query) {
+    char *goods = strdup(query->goods);
+    take_read_lock(&depotContents->goodsLock);
+    for (char *good = strtok(goods, ":"); good != NULL; 
+            good = strtok(NULL, ":")) {
+        int index = good_at_depot(depotContents, good, hash_name(good));
+        int quantity = index == -1 ? 0 : __atomic_load_n(
+                &depotContents->goods[index].quantity, __ATOMIC_RELAXED);
+        if (quantity != 0) {
+            char *entry = malloc(strlen(depotContents->name) + 
+                    strlen(good) + 16);
+            sprintf(entry, ":%s:%s:%d", depotContents->name, good, quantity);
+            append_entries(query, entry);
+            free(entry);
+        }
+    }
+    release_rw_lock(&depotContents->goodsLock);
+    free(goods);
+}
+
+// Add holdings, as :depot:good:quantity for each, to a query's answer
+// The query lock must be held by the caller
+void append_entries(Query *query, const char *entries) {
+    size_t length = strlen(entries);
+    if (query->entriesLength + length + 1 > query->entriesAllocated) {
+        query->entriesAllocated = 2 * (query->entriesLength + length) + 64;
+        query->entries = realloc(query->entries, query->entriesAllocated);
+    }
+    memcpy(query->entries + query->entriesLength, entries, length + 1);
+    query->entriesLength += length;
+}
+
+// Pass a query on to every neighbouring depot but the one it came from, 
+// unless it may go no further. The neighbour lock and query lock must be
+// held by the caller. reactor is the reactor we are running on and hops 
+// is how much further the query may go. Return how many it was passed to
+int pass_on_query(DepotContents *depotContents, Reactor *reactor, 
+        Query *query, int hops) {
+    if (hops == 0) {
+        return 0;
+    }
+    char *line = malloc(strlen(query->origin) + strlen(query->goods) + 48);
+    sprintf(line, "Probe:%d:%d:%s:%s\n", hops - 1, query->serial, 
+            query->origin, query->goods);
+    int count = 0;
+    for (int i = 0; i < depotContents->numNeighbours; i++) {
+        Connection *connection = depotContents->neighbourConnections[i];
+        if (i != query->parent && connection != NULL && 
+                connection->isDepot) {
+            send_to_neighbour(depotContents, reactor, i, line);
+            count++;
+        }
+    }
+    free(line);
+    return count;
+}
+
+// Answer a query to its parent, with what has been heard so far. A query
+// this depot started is answered to the client which asked, and the 
+// answer cached. It is then kept until a timeout later, so any copies 
+// still on their way are recognised. The neighbour lock and query lock 
+// must be held by the caller. reactor is the reactor we are running on
+void finish_query(DepotContents *depotContents, Reactor *reactor, 
+        Query *query) {
+    query->done = true;
+    query->deadline = current_millis() + depotContents->queryTimeout;
+    if (query->local) {
+        char *reply = format_answer(query);
+        send_to_neighbour(depotContents, reactor, query->parent, reply);
+        cache_answer(depotContents, query_key(query->hops, query->goods),
+                reply);
+        return;
+    }
+    char *line = malloc(strlen(query->origin) + query->entriesLength + 32);
+    sprintf(line, "Answer:%d:%s%s\n", query->serial, query->origin, 
+            query->entries == NULL ? "" : query->entries);
+    send_to_neighbour(depotContents, reactor, query->parent, line);
+    free(line);
+}
+
+// Compare two holdings by depot and then good, for use with qsort
+// a and b are the Holding pointers being compared
+int compare_holdings(const void *a, const void *b) {
+    const Holding *first = a;
+    const Holding *second = b;
+    int order = strcmp(first->depot, second->depot);
+    return order ? order : strcmp(first->good, second->good);
+}
+
+// Format the reply to a query this depot started, from the holdings in its
+// answer. They are sorted, and a depot which was heard from more than once
+// is only counted once. Return the reply, which the caller must free
+char *format_answer(Query *query) {
+    char *entries = query->entries == NULL ? strdup("") : 
+            strdup(query->entries);
+    size_t maxHoldings = 1;
+    for (size_t i = 0; entries[i] != '\0'; i++) {
+        maxHoldings += entries[i] == ':';
+    }
+    Holding *holdings = malloc((maxHoldings / 3 + 1) * sizeof(Holding));
+    int numHoldings = 0;
+    // each holding is :depot:good:quantity
+    char *field = entries;
+    while (field != NULL && *field == ':') {
+        char *depot = field + 1;
+        char *good = strchr(depot, ':');
+        char *quantity = good == NULL ? NULL : strchr(good + 1, ':');
+        if (quantity == NULL) {
+            break;
+        }
+        *good++ = '\0';
+        *quantity++ = '\0';
+        field = strchr(quantity, ':');
+        holdings[numHoldings].depot = depot;
+        holdings[numHoldings].good = good;
+        holdings[numHoldings++].quantity = atoi(quantity);
+    }
+    qsort(holdings, numHoldings, sizeof(Holding), compare_holdings);
+
+    char *text;
+    size_t length;
+    FILE *out = open_memstream(&text, &length);
+    for (int i = 0; i < numHoldings; i++) {
+        if (i > 0 && !compare_holdings(&holdings[i - 1], &holdings[i])) {
+            holdings[i].quantity = 0;
+            continue;
+        }
+        fprintf(out, "Held:%s:%s:%d\n", holdings[i].depot, holdings[i].good,
+                holdings[i].quantity);
+    }
+    char *goods = strdup(query->goods);
+    for (char *good = strtok(goods, ":"); good != NULL; 
+            good = strtok(NULL, ":")) {
+        long total = 0;
+        for (int i = 0; i < numHoldings; i++) {
+            if (!strcmp(holdings[i].good, good)) {
+                total += holdings[i].quantity;
+            }
+        }
+        fprintf(out, "Total:%s:%ld\n", good, total);
+    }
+    fclose(out);
+    free(goods);
+    free(holdings);
+    free(entries);
+    return text;
+}
+
+// Return the key a query's reply is cached under, made from its hop limit
+// and the goods it asks about as they were parsed, so the same query is
+// found however its numbers were written. The caller must free it
+char *query_key(int hops, char *goods) {
+    char *key = malloc(strlen(goods) + 16);
+    if (key == NULL) {
+        //memory failure
+        exit(99);
+    }
+    sprintf(key, "%d:%s", hops, goods);
+    return key;
+}
+
+// Keep the reply to a query so the same query can be answered straight 
+// away for a while, replacing the oldest reply if the cache is full. The
+// query lock must be held by the caller. key is from query_key, and reply
+// is the reply. Both are owned by the cache from then on
+void cache_answer(DepotContents *depotContents, char *key, char *reply) {
+    CachedAnswer *slot = &depotContents->answers[0];
+    for (int i = 0; i < QUERY_CACHE_SIZE; i++) {
+        CachedAnswer *answer = &depotContents->answers[i];
+        if (answer->key != NULL && !strcmp(answer->key, key)) {
+            slot = answer;
+            break;
+        }
+        if (answer->expires < slot->expires) {
+            slot = answer;
+        }
+    }
+    free(slot->key);
+    free(slot->reply);
+    slot->key = key;
+    slot->reply = reply;
+    slot->expires = current_millis() + depotContents->queryTtl;
+}
+
+// Return a copy of the cached reply to a query, or NULL if there isn't 
+// one or it is too old. key is from query_key
+char *cached_answer(DepotContents *depotContents, char *key) {
+    char *reply = NULL;
+    long now = current_millis();
+    pthread_mutex_lock(&depotContents->queryLock);
+    for (int i = 0; i < QUERY_CACHE_SIZE; i++) {
+        CachedAnswer *answer = &depotContents->answers[i];
+        if (answer->key != NULL && answer->expires > now && 
+                !strcmp(answer->key, key)) {
+            reply = strdup(answer->reply);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&depotContents->queryLock);
+    return reply;
+}
+
+// Answer every query which has waited too long for the depots it was 
+// passed on to, and forget those answered long enough ago. reactor is the
+// reactor we are running on
+void check_queries(DepotContents *depotContents, Reactor *reactor) {
+    if (__atomic_load_n(&depotContents->numQueries, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    long now = current_millis();
+    take_read_lock(&depotContents->neighbourLock);
+    pthread_mutex_lock(&depotContents->queryLock);
+    for (int i = 0; i < depotContents->numQueries; i++) {
+        Query *query = &depotContents->queries[i];
+        if (query->deadline > now) {
+            continue;
+        }
+        if (!query->done) {
+            finish_query(depotContents, reactor, query);
+            continue;
+        }
+        free(query->origin);
+        free(query->goods);
+        free(query->entries);
+        *query = depotContents->queries[depotContents->numQueries - 1];
+        __atomic_store_n(&depotContents->numQueries, 
+                depotContents->numQueries - 1, __ATOMIC_RELEASE);
+        i--;
+    }
+    pthread_mutex_unlock(&depotContents->queryLock);
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Return how many milliseconds the event loop can wait before a query 
+// needs to be checked, or -1 if it can wait forever
+int query_wait(DepotContents *depotContents) {
+    if (__atomic_load_n(&depotContents->numQueries, __ATOMIC_ACQUIRE) == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&depotContents->queryLock);
+    long deadline = -1;
+    for (int i = 0; i < depotContents->numQueries; i++) {
+        if (deadline == -1 || depotContents->queries[i].deadline < deadline) {
+            deadline = depotContents->queries[i].deadline;
+        }
+    }
+    pthread_mutex_unlock(&depotContents->queryLock);
+    if (deadline == -1) {
+        return -1;
+    }
+    long wait = deadline - current_millis();
+    return wait < 0 ? 0 : wait;
+}
+
+// Note that a good has changed, so mirrors are sent it with the next 
+// update. Each good is only listed once however often it changes. The 
+// goods lock must be held by the caller. good is what has changed
+void note_change(DepotContents *depotContents, Good *good) {
+    if (__atomic_load_n(&depotContents->numMirrors, __ATOMIC_ACQUIRE) == 0 ||
+            __atomic_exchange_n(&good->changed, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_mutex_lock(&depotContents->mirrorLock);
+    if (depotContents->numChanged == depotContents->allocatedChanged) {
+        depotContents->allocatedChanged = depotContents->allocatedChanged ?
+                depotContents->allocatedChanged * 2 : 64;
+        depotContents->changedGoods = realloc(depotContents->changedGoods,
+                depotContents->allocatedChanged * sizeof(int));
+        if (depotContents->changedGoods == NULL) {
+            //memory failure
+            exit(99);
+        }
+    }
+    depotContents->changedGoods[depotContents->numChanged] = good->id;
+    // mirror_wait looks at this without the lock
+    __atomic_store_n(&depotContents->numChanged, 
+            depotContents->numChanged + 1, __ATOMIC_RELEASE);
+    bool first = depotContents->numChanged == 1;
+    pthread_mutex_unlock(&depotContents->mirrorLock);
+    // the first reactor sends updates, and may be waiting with no timeout
+    if (first) {
+        uint64_t one = 1;
+        write(depotContents->reactors[0].inboxFd, &one, sizeof(one));
+    }
+}
+
+// Handle a Follow message, which makes this depot a mirror of the named
+// neighbour. It asks for all the neighbour's goods now if it is 
+// connected, and again whenever it connects. connection is where the 
+// message came from and name is the depot to mirror
+void follow_depot(DepotContents *depotContents, Connection *connection, 
+        char *name) {
+    if (!valid_name(name)) {
+        return;
+    }
+    take_write_lock(&depotContents->neighbourLock);
+    free(depotContents->followName);
+    depotContents->followName = strdup(name);
+    if (depotContents->followName == NULL) {
+        //memory failure
+        exit(99);
+    }
+    depotContents->followSerial = 0;
+    for (int i = find_neighbour(depotContents, name); i != -1; 
+            i = depotContents->nextSameName[i]) {
+        send_to_neighbour(depotContents, 
+                message_reactor(depotContents, connection), i, 
+                "Mirror:\n");
+    }
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Handle a Mirror message from a neighbour, which wants to be sent our 
+// goods as they change. It is sent all of them in a Resync first, then 
+// Updates listing the goods which changed since the last one
+// connection is the neighbour which wants them
+void add_mirror(DepotContents *depotContents, Connection *connection) {
+    if (connection->neighbour == -1) {
+        return;
+    }
+    take_write_lock(&depotContents->neighbourLock);
+    bool added = !connection->mirror;
+    if (added) {
+        if (depotContents->numMirrors == 
+                depotContents->allocatedMirrors) {
+            depotContents->allocatedMirrors += 10;
+            depotContents->mirrors = realloc(depotContents->mirrors,
+                    depotContents->allocatedMirrors * sizeof(int));
+            if (depotContents->mirrors == NULL) {
+                //memory failure
+                exit(99);
+            }
+        }
+        depotContents->mirrors[depotContents->numMirrors] = 
+                connection->neighbour;
+        connection->mirror = true;
+    }
+    // no goods are changing while we hold the goods lock for writing, so 
+    // every change is either in the resync or noted for the next update
+    take_write_lock(&depotContents->goodsLock);
+    if (added) {
+        __atomic_store_n(&depotContents->numMirrors, 
+                depotContents->numMirrors + 1, __ATOMIC_RELEASE);
+    }
+    char *line = format_mirror(depotContents, "Resync", 
+            __atomic_add_fetch(&depotContents->mirrorSerial, 1, 
+            __ATOMIC_RELAXED), NULL, 0);
+    release_rw_lock(&depotContents->goodsLock);
+    send_message(connection, "%s", line);
+    release_rw_lock(&depotContents->neighbourLock);
+    free(line);
+}
+
+// Stop sending goods to a neighbour which was mirroring them. The 
+// neighbour lock must be held for writing by the caller
+// neighbour is the mirror to forget
+void remove_mirror(DepotContents *depotContents, int neighbour) {
+    for (int i = 0; i < depotContents->numMirrors; i++) {
+        if (depotContents->mirrors[i] == neighbour) {
+            depotContents->mirrors[i] = 
+                    depotContents->mirrors[depotContents->numMirrors - 1];
+            __atomic_store_n(&depotContents->numMirrors, 
+                    depotContents->numMirrors - 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+// Format the message sending goods to mirrors, command:serial{:qty:good}
+// ids lists the goods to send, or is NULL for all of them, in which case
+// numIds is ignored. The goods being sent are marked unchanged, so a 
+// change made after they are read is sent next time. The goods lock must
+// be held by the caller. Return the message, which the caller must free
+char *format_mirror(DepotContents *depotContents, const char *command, 
+        unsigned long serial, int *ids, int numIds) {
+    char *line;
+    size_t length;
+    FILE *out = open_memstream(&line, &length);
+    if (out == NULL) {
+        //memory failure
+        exit(99);
+    }
+    fprintf(out, "%s:%lu", command, serial);
+    size_t count = ids == NULL ? depotContents->allocatedGoods : numIds;
+    for (size_t i = 0; i < count; i++) {
+        Good *good = ids == NULL ? &depotContents->goods[i] : 
+                &depotContents->goods[depotContents->goodSlots[ids[i]]];
+        if (good->name == NULL) {
+            continue;
+        }
+        // a resync leaves the changes for the other mirrors' next update
+        if (ids != NULL) {
+            __atomic_store_n(&good->changed, false, __ATOMIC_RELEASE);
+        }
+        fprintf(out, ":%d:%s", 
+                __atomic_load_n(&good->quantity, __ATOMIC_ACQUIRE), 
+                good->name);
+    }
+    fprintf(out, "\n");
+    fclose(out);
+    return line;
+}
+
+// Send mirrors an Update of the goods changed since the last one. Changes
+// are gathered for mirrorInterval milliseconds after an update, so a good
+// changed many times in that time is only sent once, with its quantity
+// at the time of sending. reactor is the reactor we are running on
+void flush_mirrors(DepotContents *depotContents, Reactor *reactor) {
+    if (__atomic_load_n(&depotContents->numChanged, __ATOMIC_ACQUIRE) == 0 ||
+            current_millis() < depotContents->nextMirrorFlush) {
+        return;
+    }
+    pthread_mutex_lock(&depotContents->mirrorLock);
+    int *ids = depotContents->changedGoods;
+    int numIds = depotContents->numChanged;
+    depotContents->changedGoods = NULL;
+    depotContents->allocatedChanged = 0;
+    __atomic_store_n(&depotContents->numChanged, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&depotContents->mirrorLock);
+    depotContents->nextMirrorFlush = current_millis() + 
+            depotContents->mirrorInterval;
+
+    take_read_lock(&depotContents->neighbourLock);
+    take_read_lock(&depotContents->goodsLock);
+    char *line = format_mirror(depotContents, "Update", 
+            __atomic_add_fetch(&depotContents->mirrorSerial, 1, 
+            __ATOMIC_RELAXED), ids, numIds);
+    release_rw_lock(&depotContents->goodsLock);
+    for (int i = 0; i < depotContents->numMirrors; i++) {
+        send_to_neighbour(depotContents, reactor, depotContents->mirrors[i],
+                line);
+    }
+    release_rw_lock(&depotContents->neighbourLock);
+    free(line);
+    free(ids);
+}
+
+// Return how many milliseconds the first reactor can wait before it must
+// send mirrors an update, or -1 if nothing has changed
+int mirror_wait(DepotContents *depotContents) {
+    if (__atomic_load_n(&depotContents->numChanged, __ATOMIC_ACQUIRE) == 0) {
+        return -1;
+    }
+    long wait = depotContents->nextMirrorFlush - current_millis();
+    return wait < 0 ? 0 : wait;
+}
+
+// Handle a Resync or Update from the depot we mirror, in the format 
+// serial{:qty:good}. They give what the depot holds of each good, so 
+// they can be applied more than once. A resync lists every good, and any
+// not listed are set to none. Anything with an older serial than the last
+// resync was sent before it and is ignored. Nothing is changed unless 
+// every item is valid. connection is where it came from, message is the 
+// rest of it, which is split up in place, and resync is which it is
+void mirror_goods(DepotContents *depotContents, Connection *connection, 
+        char *message, bool resync) {
+    char *field;
+    errno = 0;
+    unsigned long serial = strtoul(message, &field, 10);
+    if (message[0] < '0' || message[0] > '9' || errno == ERANGE || 
+            (*field != ':' && *field != '\0')) {
+        return;
+    }
+    int maxItems = 1;
+    for (int i = 0; field[i] != '\0'; i++) {
+        if (field[i] == ':') {
+            maxItems++;
+        }
+    }
+    BatchItem *items = (BatchItem *)scratch_buffer(connection, 
+            (maxItems / 2 + 1) * sizeof(BatchItem));
+    int numItems = 0;
+    field = *field == ':' ? field + 1 : NULL;
+    while (field != NULL) {
+        char *name = strchr(field, ':');
+        if (name == NULL) {
+            return;
+        }
+        *name++ = '\0';
+        char *next = strchr(name, ':');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        char *end;
+        errno = 0;
+        long quantity = strtol(field, &end, 10);
+        if (end == field || *end != '\0' || errno == ERANGE || 
+                quantity < INT_MIN || quantity > INT_MAX || 
+                !valid_name(name)) {
+            return;
+        }
+        items[numItems].name = name;
+        items[numItems].hash = hash_name(name);
+        items[numItems++].quantity = quantity;
+        field = next;
+    }
+
+    take_read_lock(&depotContents->neighbourLock);
+    // other neighbours with the same name may be read at the same time
+    if (!followed(depotContents, connection) || serial < 
+            __atomic_load_n(&depotContents->followSerial, __ATOMIC_RELAXED)) {
+        release_rw_lock(&depotContents->neighbourLock);
+        return;
+    }
+    if (resync) {
+        __atomic_store_n(&depotContents->followSerial, serial, 
+                __ATOMIC_RELAXED);
+    }
+    take_write_lock(&depotContents->goodsLock);
+    for (size_t i = 0; resync && i < depotContents->allocatedGoods; i++) {
+        Good *good = &depotContents->goods[i];
+        if (good->name != NULL && good->quantity != 0) {
+            log_goods(depotContents, good->name, -good->quantity);
+            good->quantity = 0;
+            note_change(depotContents, good);
+        }
+    }
+    for (int i = 0; i < numItems; i++) {
+        int index = good_at_depot(depotContents, items[i].name, 
+                items[i].hash);
+        int held = index == -1 ? 0 : depotContents->goods[index].quantity;
+        if (items[i].quantity == held) {
+            continue;
+        }
+        // the journal adds it on, wrapping round just as the sum does
+        log_goods(depotContents, items[i].name, 
+                (int)((unsigned int)items[i].quantity - (unsigned int)held));
+        if (index == -1) {
+            insert_good(depotContents, items[i].name, items[i].hash, 
+                    items[i].quantity);
+        } else {
+            depotContents->goods[index].quantity = items[i].quantity;
+            note_change(depotContents, &depotContents->goods[index]);
+        }
+    }
+    release_rw_lock(&depotContents->goodsLock);
+    release_rw_lock(&depotContents->neighbourLock);
+}
+
+// Return whether connection is to the depot we mirror. The neighbour lock
+// must be held by the caller
+bool followed(DepotContents *depotContents, Connection *connection) {
+    return depotContents->followName != NULL && connection->neighbour != -1 &&
+            !strcmp(depotContents->neighbours[connection->neighbour], 
+            depotContents->followName);
+}
+
+// Set up the journal if DEPOT_STATE names a directory to keep it in, and
+// restore the depot from the latest snapshot and the logs after it
+// There is no journal while replaying a capture, so the replayed traffic
+// doesn't change a real depot's state. Return true if there was anything
+// to restore
+bool open_journal(DepotContents *depotContents) {
+    Journal *journal = &depotContents->journal;
+    journal->enabled = false;
+    journal->snapshotPid = 0;
+    journal->directory = getenv("DEPOT_STATE");
+    if (journal->directory == NULL || getenv("DEPOT_REPLAY") != NULL) {
+        return false;
+    }
+    size_t length = strlen(journal->directory) + 
+            strlen(depotContents->name) + 2;
+    journal->prefix = malloc(length);
+    journal->snapshotPath = malloc(length + 5);
+    journal->tempPath = malloc(length + 9);
+    sprintf(journal->prefix, "%s/%s", journal->directory, 
+            depotContents->name);
+    sprintf(journal->snapshotPath, "%s.snap", journal->prefix);
+    sprintf(journal->tempPath, "%s.snap.tmp", journal->prefix);
+
+    journal->sinceSnapshot = 0;
+    unsigned long generation = load_snapshot(depotContents);
+    bool restored = generation > 0;
+    while (replay_log(depotContents, generation + 1)) {
+        generation++;
+        restored = true;
+    }
+    // a log cut short by a crash is left alone and logging carries on in
+    // a new one
+    journal->generation = generation + 1;
+    journal->fd = open_log(journal, journal->generation);
+    journal->nextFd = -1;
+    journal->buffer = NULL;
+    journal->spare = NULL;
+    journal->length = 0;
+    journal->allocated = 0;
+    journal->spareAllocated = 0;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->ready, NULL);
+    pthread_create(&journal->writer, NULL, journal_writer, journal);
+    journal->enabled = true;
+    return restored;
+}
+
+// Return the path of the log of the given generation, which the caller 
+// must free
+char *log_path(Journal *journal, unsigned long generation) {
+    char *path = malloc(strlen(journal->prefix) + 32);
+    sprintf(path, "%s.log.%lu", journal->prefix, generation);
+    return path;
+}
+
+// Create the log of the given generation and return its descriptor
+int open_log(Journal *journal, unsigned long generation) {
+    char *path = log_path(journal, generation);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    free(path);
+    if (fd == -1) {
+        perror("Journal");
+        exit(4);
+    }
+    return fd;
+}
+
+// Thread which writes out and syncs everything logged since it last did,
+// so the event loop never waits for the disk. arg is the journal
+void *journal_writer(void *arg) {
+    Journal *journal = arg;
+    while (1) {
+        pthread_mutex_lock(&journal->lock);
+        while (journal->length == 0 && journal->nextFd == -1) {
+            pthread_cond_wait(&journal->ready, &journal->lock);
+        }
+        unsigned char *records = journal->buffer;
+        size_t length = journal->length;
+        size_t allocated = journal->allocated;
+        journal->buffer = journal->spare;
+        journal->allocated = journal->spareAllocated;
+        journal->spare = NULL;
+        journal->spareAllocated = 0;
+        journal->length = 0;
+        int fd = journal->fd;
+        int nextFd = journal->nextFd;
+        size_t cutLength = nextFd == -1 ? length : journal->cutLength;
+        if (nextFd != -1) {
+            journal->fd = nextFd;
+            journal->nextFd = -1;
+        }
+        pthread_mutex_unlock(&journal->lock);
+
+        write_fully(fd, records, cutLength);
+        fdatasync(fd);
+        if (nextFd != -1) {
+            close(fd);
+            write_fully(nextFd, records + cutLength, length - cutLength);
+            fdatasync(nextFd);
+        }
+
+        pthread_mutex_lock(&journal->lock);
+        journal->spare = records;
+        journal->spareAllocated = allocated;
+        pthread_mutex_unlock(&journal->lock);
+    }
+    return NULL;
+}
+
+// Write all of data, which is length bytes long, to fd
+void write_fully(int fd, const void *data, size_t length) {
+    const char *next = data;
+    while (length > 0) {
+        ssize_t count = write(fd, next, length);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1) {
+            perror("Journal");
+            exit(4);
+        }
+        next += count;
+        length -= count;
+    }
+}
+
+// Make room for a record of at most size bytes at the end of the journal
+// and return where to put it. The journal is locked until commit_journal
+unsigned char *reserve_journal(Journal *journal, size_t size) {
+    pthread_mutex_lock(&journal->lock);
+    if (journal->length + size > journal->allocated) {
+        size_t allocated = journal->allocated ? journal->allocated : 
+                OUTPUT_CHUNK;
+        while (allocated < journal->length + size) {
+            allocated *= 2;
+        }
+        journal->buffer = realloc(journal->buffer, allocated);
+        if (journal->buffer == NULL) {
+            //memory failure
+            exit(99);
+        }
+        journal->allocated = allocated;
+    }
+    return journal->buffer + journal->length;
+}
+
+// Add the record of the given length written after reserve_journal to the
+// journal, waking the writer if it is waiting for something to do
+void commit_journal(Journal *journal, size_t length) {
+    if (journal->length == 0) {
+        pthread_cond_signal(&journal->ready);
+    }
+    journal->length += length;
+    __atomic_store_n(&journal->sinceSnapshot, journal->sinceSnapshot + length,
+            __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Log that quantity of the named good was added (or removed if negative)
+void log_goods(DepotContents *depotContents, char *name, int quantity) {
+    if (!depotContents->journal.enabled) {
+        return;
+    }
+    unsigned char *record = reserve_journal(&depotContents->journal, 
+            MAX_LOG_RECORD + strlen(name));
+    commit_journal(&depotContents->journal, 
+            put_goods_record(record, name, quantity));
+}
+
+// Write the record of quantity of the named good being added to record,
+// which must have room for MAX_LOG_RECORD bytes and the name
+// Return the length of the record
+size_t put_goods_record(unsigned char *record, char *name, int quantity) {
+    size_t length = strlen(name);
+    size_t used = 0;
+    record[used++] = LOG_GOODS;
+    used += put_varint(record + used, length);
+    memcpy(record + used, name, length);
+    used += length;
+    used += put_varint(record + used, 
+            ((unsigned int)quantity << 1) ^ (unsigned int)(quantity >> 31));
+    return used;
+}
+
+// Log that message, which is length bytes long, was deferred until key
+void log_defer(DepotContents *depotContents, int key, char *message,
+        size_t length) {
+    if (!depotContents->journal.enabled) {
+        return;
+    }
+    unsigned char *record = reserve_journal(&depotContents->journal, 
+            MAX_LOG_RECORD + length);
+    size_t used = 0;
+    record[used++] = LOG_DEFER;
+    used += put_varint(record + used, key);
+    used += put_varint(record + used, length);
+    memcpy(record + used, message, length);
+    used += length;
+    commit_journal(&depotContents->journal, used);
+}
+
+// Log that the messages waiting for key were executed. What they did is
+// logged by the messages themselves, so replaying this only drops them
+void log_execute(DepotContents *depotContents, int key) {
+    if (!depotContents->journal.enabled) {
+        return;
+    }
+    unsigned char *record = reserve_journal(&depotContents->journal, 
+            MAX_LOG_RECORD);
+    size_t used = 0;
+    record[used++] = LOG_EXECUTE;
+    used += put_varint(record + used, key);
+    commit_journal(&depotContents->journal, used);
+}
+
+// Exit because the given state file can't be used
+void corrupt_state(const char *path) {
+    fprintf(stderr, "Corrupt state file %s\n", path);
+    exit(4);
+}
+
+// Restore the depot from its snapshot, if it has one. The snapshot is 
+// mapped and its goods table copied straight into place, with names left
+// pointing into the mapping, so this doesn't depend on how long the depot
+// has been running. Return the generation of the snapshot, or 0 if there
+// isn't one
+unsigned long load_snapshot(DepotContents *depotContents) {
+    char *path = depotContents->journal.snapshotPath;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror("Journal");
+            exit(4);
+        }
+        return 0;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = info.st_size;
+    if (size < sizeof(SnapshotHeader)) {
+        corrupt_state(path);
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Journal");
+        exit(4);
+    }
+    SnapshotHeader *header = (SnapshotHeader *)map;
+    size_t allocated = header->allocatedGoods;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+            allocated < MIN_GOODS_SLOTS || (allocated & (allocated - 1)) ||
+            allocated > size / sizeof(SnapshotGood) ||
+            2 * header->numItems > allocated ||
+            header->namesLength > size - sizeof(SnapshotHeader) -
+            allocated * sizeof(SnapshotGood)) {
+        corrupt_state(path);
+    }
+    SnapshotGood *slots = (SnapshotGood *)(map + sizeof(SnapshotHeader));
+    char *names = (char *)(slots + allocated);
+    if (header->namesLength > 0 && names[header->namesLength - 1] != '\0') {
+        corrupt_state(path);
+    }
+
+    Good *goods = calloc(allocated, sizeof(Good));
+    int *goodSlots = malloc(allocated * sizeof(int));
+    if (goods == NULL || goodSlots == NULL) {
+        //memory failure
+        exit(99);
+    }
+    for (size_t i = 0; i < allocated; i++) {
+        if (slots[i].nameOffset == -1) {
+            continue;
+        }
+        if (slots[i].nameOffset < 0 || 
+                (unsigned long)slots[i].nameOffset >= header->namesLength) {
+            corrupt_state(path);
+        }
+        if (slots[i].id < 0 || slots[i].id >= (long)header->numItems) {
+            corrupt_state(path);
+        }
+        // the names are used where they are mapped, so they are never 
+        // copied into the name pool
+        goods[i].name = names + slots[i].nameOffset;
+        goods[i].hash = slots[i].hash;
+        goods[i].quantity = slots[i].quantity;
+        goods[i].id = slots[i].id;
+        goodSlots[goods[i].id] = i;
+    }
+    free(depotContents->goods);
+    free(depotContents->goodSlots);
+    depotContents->goods = goods;
+    depotContents->goodSlots = goodSlots;
+    depotContents->allocatedGoods = allocated;
+    depotContents->numItems = header->numItems;
+
+    size_t offset = (names + header->namesLength) - map;
+    for (unsigned long i = 0; i < header->numDeferred; i++) {
+        SnapshotDeferred entry;
+        if (sizeof(entry) > size - offset) {
+            corrupt_state(path);
+        }
+        memcpy(&entry, map + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.key < 0 || entry.arenaLength > size - offset) {
+            corrupt_state(path);
+        }
+        DeferredMessage *deferred = find_key(depotContents, entry.key, true);
+        deferred->arena = malloc(entry.arenaLength);
+        memcpy(deferred->arena, map + offset, entry.arenaLength);
+        deferred->arenaLength = entry.arenaLength;
+        deferred->arenaAllocated = entry.arenaLength;
+        deferred->numMessages = entry.numMessages;
+        touch_key(depotContents, deferred);
+        threadStats->deferredDepth += entry.numMessages;
+        depotContents->deferredBytes += entry.arenaLength;
+        // the messages are parsed again, as ops aren't kept in snapshots
+        size_t start = 0;
+        for (int j = 0; j < entry.numMessages; j++) {
+            char *end = memchr(deferred->arena + start, '\0', 
+                    entry.arenaLength - start);
+            if (end == NULL) {
+                corrupt_state(path);
+            }
+            compile_deferred(depotContents, deferred, start);
+            start = end + 1 - deferred->arena;
+        }
+        offset += entry.arenaLength;
+    }
+    return header->generation;
+}
+
+// Apply every record in the log of the given generation. A record cut
+// short by a crash ends the log. Return false if there is no such log
+bool replay_log(DepotContents *depotContents, unsigned long generation) {
+    char *path = log_path(&depotContents->journal, generation);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = info.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Journal");
+        exit(4);
+    }
+    unsigned char *pos = map;
+    unsigned char *end = map + size;
+    while (pos < end) {
+        unsigned char type = *pos++;
+        unsigned int first;
+        unsigned int second;
+        if (get_varint(&pos, end, &first) != 1) {
+            break;
+        }
+        if (type == LOG_EXECUTE) {
+            DeferredMessage taken;
+            if (take_deferred(depotContents, first, &taken)) {
+                free(taken.arena);
+                free(taken.ops);
+            }
+        } else if (type == LOG_GOODS && first < (size_t)(end - pos)) {
+            char *name = strndup((char *)pos, first);
+            pos += first;
+            if (get_varint(&pos, end, &second) != 1) {
+                free(name);
+                break;
+            }
+            add_goods(depotContents, name, 
+                    (int)(second >> 1) ^ -(int)(second & 1));
+            free(name);
+        } else if (type == LOG_DEFER && 
+                get_varint(&pos, end, &second) == 1 &&
+                second <= (size_t)(end - pos)) {
+            store_deferred(depotContents, first, (char *)pos, second, 0);
+            pos += second;
+        } else {
+            break;
+        }
+    }
+    munmap(map, size);
+    depotContents->journal.sinceSnapshot += size;
+    return true;
+}
+
+// Take a snapshot if enough has been logged since the last one and one
+// isn't already being written. Any reactor may take it. If the last one
+// is still to be reaped (its SIGCHLD can come before we know which child
+// it was) it is reaped here instead
+// reactor is the reactor checking
+void check_snapshot(DepotContents *depotContents, Reactor *reactor) {
+    Journal *journal = &depotContents->journal;
+    if (!journal->enabled || __atomic_load_n(&journal->sinceSnapshot, 
+            __ATOMIC_RELAXED) < SNAPSHOT_BYTES) {
+        return;
+    }
+    pthread_mutex_lock(&journal->lock);
+    pid_t pid = journal->snapshotPid;
+    bool due = pid == 0 && journal->nextFd == -1;
+    if (due) {
+        // claim it, so no other reactor starts one
+        journal->snapshotPid = -1;
+    }
+    pthread_mutex_unlock(&journal->lock);
+    if (due) {
+        take_snapshot(depotContents, reactor);
+    } else if (pid > 0) {
+        reap_snapshot(depotContents);
+    }
+}
+
+// Start a new log and fork a child to write a snapshot of everything up 
+// to the end of the old one. The child has its own copy of the depot, so
+// the event loop carries on while the snapshot is written
+void take_snapshot(DepotContents *depotContents, Reactor *reactor) {
+    Journal *journal = &depotContents->journal;
+    int fd = open_log(journal, journal->generation + 1);
+    // nothing can change while the log is cut and the depot copied
+    pause_reactors(depotContents, reactor);
+    pthread_mutex_lock(&journal->lock);
+    journal->nextFd = fd;
+    journal->cutLength = journal->length;
+    __atomic_store_n(&journal->sinceSnapshot, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&journal->ready);
+    journal->snapshotGeneration = journal->generation++;
+    pthread_mutex_unlock(&journal->lock);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        write_snapshot(depotContents, journal->snapshotGeneration);
+    }
+    resume_reactors(depotContents);
+    // if we couldn't fork the logs are kept until the next snapshot
+    pthread_mutex_lock(&journal->lock);
+    journal->snapshotPid = pid == -1 ? 0 : pid;
+    pthread_mutex_unlock(&journal->lock);
+}
+
+// Add data, which is length bytes long, to the snapshot being written
+void snapshot_write(SnapshotWriter *writer, const void *data, 
+        size_t length) {
+    const char *next = data;
+    while (length > 0) {
+        size_t count = SNAPSHOT_BUFFER - writer->length;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(writer->data + writer->length, next, count);
+        writer->length += count;
+        next += count;
+        length -= count;
+        if (writer->length == SNAPSHOT_BUFFER) {
+            flush_snapshot(writer);
+        }
+    }
+}
+
+// Write out everything buffered in the snapshot writer
+void flush_snapshot(SnapshotWriter *writer) {
+    size_t done = 0;
+    while (!writer->failed && done < writer->length) {
+        ssize_t count = write(writer->fd, writer->data + done, 
+                writer->length - done);
+        if (count == -1 && errno != EINTR) {
+            writer->failed = true;
+        } else if (count > 0) {
+            done += count;
+        }
+    }
+    writer->length = 0;
+}
+
+// Write a snapshot of the depot which covers every log up to generation,
+// then exit. Runs in the forked child, so it only reads the depot and 
+// doesn't allocate. The snapshot replaces the old one once it is synced
+void write_snapshot(DepotContents *depotContents, unsigned long generation) {
+    Journal *journal = &depotContents->journal;
+    static SnapshotWriter writer;
+    writer.fd = open(journal->tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    writer.length = 0;
+    writer.failed = writer.fd == -1;
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.generation = generation;
+    header.allocatedGoods = depotContents->allocatedGoods;
+    header.numItems = depotContents->numItems;
+    for (size_t i = 0; i < depotContents->allocatedGoods; i++) {
+        if (depotContents->goods[i].name != NULL) {
+            header.namesLength += strlen(depotContents->goods[i].name) + 1;
+        }
+    }
+    for (size_t i = 0; i < depotContents->allocatedDeferredMessages; i++) {
+        if (depotContents->deferredMessages[i].key != NO_KEY &&
+                depotContents->deferredMessages[i].numMessages > 0) {
+            header.numDeferred++;
+        }
+    }
+    snapshot_write(&writer, &header, sizeof(header));
+
+    long nameOffset = 0;
+    for (size_t i = 0; i < depotContents->allocatedGoods; i++) {
+        Good *good = &depotContents->goods[i];
+        SnapshotGood slot;
+        memset(&slot, 0, sizeof(slot));
+        slot.nameOffset = good->name == NULL ? -1 : nameOffset;
+        if (good->name != NULL) {
+            slot.hash = good->hash;
+            slot.quantity = good->quantity;
+            slot.id = good->id;
+            nameOffset += strlen(good->name) + 1;
+        }
+        snapshot_write(&writer, &slot, sizeof(slot));
+    }
+    for (size_t i = 0; i < depotContents->allocatedGoods; i++) {
+        char *name = depotContents->goods[i].name;
+        if (name != NULL) {
+            snapshot_write(&writer, name, strlen(name) + 1);
+        }
+    }
+    for (size_t i = 0; i < depotContents->allocatedDeferredMessages; i++) {
+        DeferredMessage *deferred = &depotContents->deferredMessages[i];
+        if (deferred->key == NO_KEY || deferred->numMessages == 0) {
+            continue;
+        }
+        SnapshotDeferred entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.key = deferred->key;
+        entry.numMessages = deferred->numMessages;
+        entry.arenaLength = deferred->arenaLength;
+        snapshot_write(&writer, &entry, sizeof(entry));
+        snapshot_write(&writer, deferred->arena, deferred->arenaLength);
+    }
+    flush_snapshot(&writer);
+
+    if (writer.failed || fsync(writer.fd) || close(writer.fd) ||
+            rename(journal->tempPath, journal->snapshotPath)) {
+        _exit(1);
+    }
+    int directory = open(journal->directory, O_RDONLY);
+    if (directory == -1 || fsync(directory)) {
+        _exit(1);
+    }
+    _exit(0);
+}
+
+// Reap a finished snapshot and, if it was written, remove the logs it 
+// covers. If it failed they are kept, and the next snapshot covers them
+void reap_snapshot(DepotContents *depotContents) {
+    Journal *journal = &depotContents->journal;
+    pthread_mutex_lock(&journal->lock);
+    pid_t pid = journal->snapshotPid;
+    unsigned long covered = journal->snapshotGeneration;
+    pthread_mutex_unlock(&journal->lock);
+    int status;
+    if (pid <= 0 || waitpid(pid, &status, WNOHANG) != pid) {
+        return;
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal->snapshotPid = 0;
+    pthread_mutex_unlock(&journal->lock);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return;
+    }
+    for (unsigned long generation = covered; 
+            generation > 0; generation--) {
+        char *path = log_path(journal, generation);
+        int removed = unlink(path);
+        free(path);
+        if (removed == -1) {
+            break;
+        }
+    }
+}
+
+// Start capturing the depot's traffic if DEPOT_CAPTURE names a file to 
+// capture it to. Nothing is captured while replaying a capture
+void open_capture(DepotContents *depotContents) {
+    Capture *capture = &depotContents->capture;
+    char *path = getenv("DEPOT_CAPTURE");
+    capture->file = NULL;
+    if (path == NULL || getenv("DEPOT_REPLAY") != NULL) {
+        return;
+    }
+    capture->file = fopen(path, "w");
+    if (capture->file == NULL) {
+        perror("Capture");
+        exit(4);
+    }
+    setvbuf(capture->file, NULL, _IOFBF, CAPTURE_BUFFER);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture->file);
+    pthread_mutex_init(&capture->lock, NULL);
+    capture->lastMicros = current_micros();
+    capture->nextId = 0;
+    capture->dirty = false;
+}
+
+// Add a record to the capture, if there is one. Records from every 
+// reactor go into the one capture in the order they happen
+// type is the kind of record, connection is the connection it is about,
+// and data is the length bytes read for a CAPTURE_READ
+void capture_event(DepotContents *depotContents, int type, 
+        Connection *connection, const char *data, size_t length) {
+    Capture *capture = &depotContents->capture;
+    if (capture->file == NULL) {
+        return;
+    }
+    unsigned char header[2 + 3 * MAX_VARINT];
+    size_t used = 0;
+    pthread_mutex_lock(&capture->lock);
+    if (type == CAPTURE_OPEN) {
+        connection->captureId = capture->nextId++;
+    }
+    long now = current_micros();
+    long elapsed = now - capture->lastMicros;
+    capture->lastMicros = now;
+    header[used++] = type;
+    used += put_varint(header + used, connection->captureId);
+    used += put_varint(header + used, 
+            elapsed > UINT_MAX ? UINT_MAX : (unsigned int)elapsed);
+    if (type == CAPTURE_OPEN) {
+        header[used++] = connection->messageSent;
+    } else if (type == CAPTURE_READ) {
+        used += put_varint(header + used, length);
+    }
+    fwrite(header, 1, used, capture->file);
+    if (type == CAPTURE_READ) {
+        fwrite(data, 1, length, capture->file);
+    }
+    capture->dirty = true;
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Write out anything added to the capture since it was last written, so 
+// little is lost if the depot is killed
+void flush_capture(DepotContents *depotContents) {
+    Capture *capture = &depotContents->capture;
+    if (capture->file == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&capture->lock);
+    if (capture->dirty) {
+        fflush(capture->file);
+        capture->dirty = false;
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Replay a capture through the depot instead of running the server, then
+// report how long it took and the goods held at the end, and exit. Each 
+// captured connection gets a connection whose output is thrown away, and
+// everything read on it goes through the same code as it did when it was
+// captured. It runs as fast as it can, unless DEPOT_REPLAY_TIMED is set, 
+// when it keeps to the times in the capture. path is the capture
+void replay_trace(DepotContents *depotContents, char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info)) {
+        perror("Replay");
+        exit(4);
+    }
+    size_t size = info.st_size;
+    unsigned char *map = size == 0 ? MAP_FAILED : 
+            mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || size < strlen(CAPTURE_MAGIC) || 
+            memcmp(map, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+        corrupt_state(path);
+    }
+    bool timed = getenv("DEPOT_REPLAY_TIMED") != NULL;
+
+    // a reactor of our own, which is never run, owns the connections
+    depotContents->reactors = calloc(1, sizeof(Reactor));
+    depotContents->numReactors = 1;
+    Reactor *reactor = &depotContents->reactors[0];
+    reactor->depotContents = depotContents;
+    reactor->epollFd = epoll_create1(0);
+    reactor->inboxFd = eventfd(0, EFD_NONBLOCK);
+    reactor->serverFd = -1;
+    reactor->localFd = -1;
+    pthread_mutex_init(&reactor->inboxLock, NULL);
+    threadStats = &reactor->stats;
+    // the limits are for live peers, and held back connections are never
+    // tried again here
+    depotContents->peerMessages = 0;
+    depotContents->peerBytes = 0;
+    depotContents->deferLimit = 0;
+
+    Connection **connections = NULL;
+    size_t allocatedConnections = 0;
+    unsigned long records = 0;
+    unsigned long bytes = 0;
+    long start = current_micros();
+    long offset = 0;
+    unsigned char *pos = map + strlen(CAPTURE_MAGIC);
+    unsigned char *end = map + size;
+    while (pos < end) {
+        int type = *pos++;
+        unsigned int id, elapsed, length = 0;
+        if (get_varint(&pos, end, &id) != 1 || 
+                get_varint(&pos, end, &elapsed) != 1 ||
+                (type == CAPTURE_OPEN && pos == end) ||
+                (type == CAPTURE_READ && (get_varint(&pos, end, &length) 
+                != 1 || length > (size_t)(end - pos)))) {
+            // a capture cut short by the depot being killed ends here
+            break;
+        }
+        offset += elapsed;
+        if (timed) {
+            long wait = start + offset - current_micros();
+            if (wait > 0) {
+                struct timespec pause = {wait / 1000000, 
+                        (wait % 1000000) * 1000};
+                nanosleep(&pause, NULL);
+            }
+        }
+        if (id >= allocatedConnections) {
+            size_t oldSize = allocatedConnections;
+            allocatedConnections = 2 * id + 16;
+            connections = realloc(connections, 
+                    allocatedConnections * sizeof(Connection *));
+            memset(connections + oldSize, 0, 
+                    (allocatedConnections - oldSize) * sizeof(Connection *));
+        }
+        if (type == CAPTURE_OPEN) {
+            connections[id] = add_connection(depotContents, reactor, 
+                    open("/dev/null", O_WRONLY), *pos++);
+        } else if (type == CAPTURE_READ && connections[id] != NULL) {
+            replay_read(depotContents, reactor, connections[id], pos, 
+                    length);
+            pos += length;
+            bytes += length;
+        } else if (type == CAPTURE_CLOSE && connections[id] != NULL) {
+            close_connection(depotContents, connections[id]);
+            connections[id] = NULL;
+        } else if (type == CAPTURE_READ) {
+            pos += length;
+        }
+        records++;
+    }
+    double seconds = (current_micros() - start) / 1e6;
+
+    Stats total;
+    sum_stats(depotContents, &total);
+    unsigned long messages = 0;
+    for (int i = 0; i < NUM_MESSAGE_TYPES; i++) {
+        messages += total.messages[i];
+    }
+    printf("Replay:records:%lu\n", records);
+    printf("Replay:bytes:%lu\n", bytes);
+    printf("Replay:messages:%lu\n", messages);
+    printf("Replay:seconds:%.6f\n", seconds);
+    printf("Replay:rate:%.0f\n", seconds > 0 ? messages / seconds : 0);
+    printf("Goods:\n");
+    print_goods(depotContents);
+    fflush(stdout);
+    exit(0);
+}
+
+// Hand bytes from a capture to a replayed connection as if they had just 
+// been read from its socket, and interpret every complete message. Any 
+// output is thrown away as it is sent, so the peer never holds us up
+// reactor is the replay's reactor, connection is the connection they were
+// read on and data is the length bytes read
+void replay_read(DepotContents *depotContents, Reactor *reactor,
+        Connection *connection, const unsigned char *data, size_t length) {
+    // a broken connection would have been closed, so reads no more
+    if (connection->broken) {
+        return;
+    }
+    if (connection->readAllocated - connection->readLength <= length) {
+        connection->readAllocated = 2 * connection->readAllocated + length + 
+                READ_CHUNK;
+        connection->readBuffer = realloc(connection->readBuffer,
+                connection->readAllocated * sizeof(char));
+    }
+    memcpy(connection->readBuffer + connection->readLength, data, length);
+    connection->readLength += length;
+    while (!process_input(depotContents, connection) && 
+            !connection->broken) {
+        flush_dirty(reactor);
+        connection->readPaused = false;
+    }
+    flush_dirty(reactor);
+}
@@ -1,4 +1,8 @@
+// struct ucred, for checking who holds a local socket
+#define _GNU_SOURCE
+
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -9,64 +13,847 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Number of reactors unless DEPOT_REACTORS says otherwise
+#define DEFAULT_REACTORS 1
+// Name of the Unix domain socket a depot also listens on, in the abstract
+// namespace, given its port. Depots on the same host connect through it
+// rather than TCP, unless DEPOT_LOCAL is 0
+#define LOCAL_NAME "2310depot:%d"
+// Maximum number of events handled per pass of the event loop
+#define MAX_EVENTS 64
+// Minimum free space in a read buffer before we read into it
+#define READ_CHUNK 4096
+// Most reads from one connection in a pass of the event loop
+#define READ_BUDGET 16
+// Size of each block of queued output
+#define OUTPUT_CHUNK 16384
+// Most blocks of output gathered into a single send
+#define MAX_IOV 64
+// Once this much output is queued for a peer we stop reading from it, and
+// start again when it has drained below LOW_WATER
+#define HIGH_WATER (1024 * 1024)
+#define LOW_WATER (256 * 1024)
+// How long, in milliseconds, a connection held back by its limits waits 
+// before it is tried again
+#define THROTTLE_TICK 10
+// Default most bytes of deferred messages kept, unless DEPOT_DEFER_BYTES
+// says otherwise. A Defer which doesn't fit is refused
+#define DEFER_BYTES (256 * 1024 * 1024)
+// Default longest line a connection may send, unless DEPOT_MAX_MESSAGE 
+// says otherwise. A connection sending a longer one is closed
+#define MAX_MESSAGE (16 * 1024 * 1024)
+
+// Smallest number of slots in the goods table
+#define MIN_GOODS_SLOTS 16
+// Size of each block of the pool goods names are interned into
+#define NAME_BLOCK 65536
+// Smallest scratch buffer given to a connection
+#define MIN_SCRATCH 256
+
+// Smallest number of slots in the neighbour name and port indexes
+#define MIN_NEIGHBOUR_SLOTS 16
+
+// Smallest number of slots in the route table
+#define MIN_ROUTE_SLOTS 16
+// Most hops a route or forwarded goods can take. A route this long is 
+// unreachable, which stops routes counting up forever around a loop
+#define MAX_HOPS 64
+
+// Defaults for how long, in milliseconds, a query waits for the depots it
+// was passed on to and how long its answer is cached. They can be changed
+// with DEPOT_QUERY_TIMEOUT and DEPOT_QUERY_TTL
+#define QUERY_TIMEOUT 500
+#define QUERY_TTL 1000
+// Most answers kept in the query cache
+#define QUERY_CACHE_SIZE 64
+
+// Default time in milliseconds between sending changed goods to mirrors,
+// unless DEPOT_MIRROR_INTERVAL says otherwise
+#define MIRROR_INTERVAL 5
+
+// Defaults for how long, in milliseconds, a Connect has to hear back from
+// the other depot and how many times it is tried. They can be changed 
+// with DEPOT_CONNECT_TIMEOUT and DEPOT_CONNECT_ATTEMPTS
+#define CONNECT_TIMEOUT 1000
+#define CONNECT_ATTEMPTS 8
+// Wait before the first retry of a Connect, doubling for each retry after
+// it up to MAX_BACKOFF
+#define CONNECT_BACKOFF 100
+#define MAX_BACKOFF 10000
+
+// Opcodes of frames in the binary protocol. Each frame is a varint length
+// followed by an opcode byte and its payload
+#define OP_TEXT 0       // a text message, for anything without its own opcode
+#define OP_GOOD 1       // varint id, name: names a good for later frames
+#define OP_DELIVER 2    // varint quantity, varint id
+#define OP_WITHDRAW 3   // varint quantity, varint id
+// Longest encoding of a 32 bit varint
+#define MAX_VARINT 5
+// Longest binary frame a peer may send. A peer sending a longer one, or a
+// length which can't be read, is disconnected
+#define MAX_FRAME (16 * 1024 * 1024)
+// Largest id a peer can give a good. Frames naming goods past it are 
+// dropped, so a bad id can't make us allocate a huge table
+#define MAX_PEER_GOODS (1 << 24)
+
+// A slot in the goods table. Empty slots have a NULL name. id is a small 
+// number which never changes, used to name the good in binary frames, and
+// changed is set while the good is waiting to be sent to mirrors
+typedef struct Good {
+    char *name;
+    unsigned int hash;
+    int quantity;
+    int id;
+    bool changed;
+} Good;
+
+// Every good's name, stored once. Names are packed one after another into
+// blocks which are never moved or freed, so pointers to them stay good for
+// the life of the depot
+typedef struct NamePool {
+    char *block;
+    size_t used;
+    size_t blockSize;
+} NamePool;
+
+// A route to another depot, learnt from the neighbours. Empty slots have a
+// NULL name. distance is in hops, and nextHop is the neighbour to send 
+// through, or -1 if the depot is unreachable
+typedef struct Route {
+    char *name;
+    unsigned int hash;
+    int distance;
+    int nextHop;
+} Route;
+
+// One good named in a Batch message. quantity is negative for withdrawals
+typedef struct BatchItem {
+    char *name;
+    unsigned int hash;
+    int quantity;
+} BatchItem;
 
+// A name and quantity copied out of the depot so it can be printed
+// without holding the lock
+typedef struct ListEntry {
+    char *name;
+    int quantity;
+} ListEntry;
+
+// Number of power of two buckets in the handler latency histograms. 
+// Bucket i counts handlers which took from 2^i up to 2^(i+1) nanoseconds
+#define NUM_LATENCY_BUCKETS 32
+
+// Types of message counted by the stats
+typedef enum MessageType {
+    TYPE_CONNECT,
+    TYPE_IM,
+    TYPE_DELIVER,
+    TYPE_WITHDRAW,
+    TYPE_BATCH,
+    TYPE_PROTOCOL,
+    TYPE_TRANSFER,
+    TYPE_DEFER,
+    TYPE_EXECUTE,
+    TYPE_SCHEDULE,
+    TYPE_STATS,
+    TYPE_ROUTE,
+    TYPE_FORWARD,
+    TYPE_QUERY,
+    TYPE_PROBE,
+    TYPE_ANSWER,
+    TYPE_MIRROR,
+    TYPE_IGNORED,
+    NUM_MESSAGE_TYPES
+} MessageType;
+
+// Counters kept while the depot runs. Each reactor has its own, which are
+// added together when they are read, so reactors don't fight over them
+typedef struct Stats {
+    unsigned long messages[NUM_MESSAGE_TYPES];
+    unsigned long handlerNanos[NUM_MESSAGE_TYPES];
+    unsigned long latency[NUM_MESSAGE_TYPES][NUM_LATENCY_BUCKETS];
+    unsigned long lockWaits;
+    unsigned long lockWaitNanos;
+    long deferredDepth;
+} Stats;
+
+// A block of output waiting to be sent. Bytes from start to length are
+// still to go
+typedef struct OutputChunk {
+    struct OutputChunk *next;
+    size_t start;
+    size_t length;
+    char data[OUTPUT_CHUNK];
+} OutputChunk;
+
+// State of a single peer connection, owned by the reactor it is on
+typedef struct Connection {
+    int fd;
+    struct Reactor *reactor;
+    char *readBuffer;
+    size_t readLength;
+    size_t readAllocated;
+    size_t readScanned;
+    bool readPaused;
+    // set once the peer has sent something we can't read past, so the 
+    // connection is closed
+    bool broken;
+    // reused for anything which only needs memory while one message is
+    // handled, such as formatting output or splitting up a Batch
+    char *scratch;
+    size_t scratchAllocated;
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+
+    // queued output, and the list of connections with output to send 
+    // which this connection joins when output is queued
+    OutputChunk *outputHead;
+    OutputChunk *outputTail;
+    size_t queuedBytes;
+    bool dirty;
+    struct Connection *nextDirty;
+    struct Connection **dirtyList;
+
+    bool initial;
+    bool messageSent;
+    // the port we dialled for a connection we made, or 0, and whether the
+    // connect is still in progress
+    int connectPort;
+    bool connecting;
+    // the number of this connection in the capture
+    unsigned int captureId;
+    // tokens left under the inbound limits on messages and bytes, and 
+    // when they were last topped up. A connection which has run out, or
+    // is sending a Defer with no room for it, isn't read until its 
+    // reactor tries it again
+    double messageTokens;
+    double byteTokens;
+    long tokensAt;
+    bool throttled;
+    struct Connection *nextThrottled;
+    // the neighbour on this connection, or -1 if it hasn't sent an IM, and
+    // whether it is a depot which takes part in routes and queries, 
+    // rather than a client
+    int neighbour;
+    bool isDepot;
+    // whether the neighbour is mirroring our goods
+    bool mirror;
+
+    // binary protocol state: which directions have switched to frames,
+    // our id for each good the peer has defined (by their id, -1 if not 
+    // defined) and which of our goods we have defined for the peer (by our
+    // id)
+    bool binaryIn;
+    bool binaryOut;
+    int *peerGoods;
+    size_t allocatedPeerGoods;
+    bool *sentGoods;
+    size_t allocatedSentGoods;
+} Connection;
+
+// Smallest number of slots in the deferred message table
+#define MIN_DEFERRED_SLOTS 16
+// Key of an empty slot in the deferred message table
+#define NO_KEY -1
+// Smallest arena allocated for a key's deferred messages
+#define MIN_ARENA 256
+
+// Smallest number of operations allocated for a key's deferred messages
+#define MIN_DEFERRED_OPS 16
+
+// Kinds of operation a deferred message is turned into when it arrives
+#define DEFER_GOODS 0       // add quantity (negative to withdraw) of good
+#define DEFER_TRANSFER 1    // withdraw quantity of good and send it on
+#define DEFER_MESSAGE 2     // any other message, interpreted when it runs
+
+// A deferred message, or one item of a deferred Batch, parsed when it 
+// arrives so Execute doesn't parse it again. good is our id for the good,
+// or -1 if the depot hadn't seen it when it was deferred, and name is 
+// where its name starts in the arena (ended by a colon or NUL). text is 
+// where the destination of a transfer, or the whole of any other 
+// message, starts in the arena
+typedef struct DeferredOp {
+    int kind;
+    int good;
+    int quantity;
+    size_t name;
+    size_t text;
+} DeferredOp;
+
+// A slot in the deferred message table. The messages waiting for the key
+// are stored one after another (each NUL terminated) in arena, which is
+// what the journal and snapshots keep, and parsed into ops. Both are 
+// freed as a whole once they are executed
 typedef struct DeferredMessage {
-    char **messages;
     int key;
     int numMessages;
-    int allocatedMessages;
-    int currentIndex;
+    char *arena;
+    size_t arenaLength;
+    size_t arenaAllocated;
+    DeferredOp *ops;
+    int numOps;
+    size_t allocatedOps;
+    // when the key was last deferred to or executed, the latest time it 
+    // is scheduled to be executed, and whether a timer to expire it is 
+    // running, all in milliseconds on the monotonic clock
+    long touched;
+    long heldUntil;
+    bool expiring;
 } DeferredMessage;
 
+// Goods sent to a neighbour by an executed transfer. They are gathered 
+// while the goods are withdrawn and sent afterwards, a neighbour at a 
+// time. order keeps them in the order they were executed, good is our id
+// for the good and destination is the depot beyond the neighbour they 
+// are forwarded to, or NULL if they are for the neighbour
+typedef struct DeferredSend {
+    int neighbour;
+    int order;
+    int good;
+    int quantity;
+    char *name;
+    char *destination;
+} DeferredSend;
+
+// Records in the write-ahead log. Each is a type byte followed by its 
+// fields. Quantities are zigzag encoded so withdrawals stay short
+#define LOG_GOODS 'G'     // varint name length, name, varint quantity
+#define LOG_DEFER 'D'     // varint key, varint message length, message
+#define LOG_EXECUTE 'E'   // varint key
+// Longest record other than its name or message
+#define MAX_LOG_RECORD (1 + 2 * MAX_VARINT)
+// Once this much has been logged a snapshot is taken, after which the 
+// logs it covers are removed
+#define SNAPSHOT_BYTES (64 * 1024 * 1024)
+// Size of the buffer a snapshot is written through
+#define SNAPSHOT_BUFFER 65536
+#define SNAPSHOT_MAGIC "2310SNAP"
+
+// Start of a snapshot file. It is followed by allocatedGoods SnapshotGoods
+// (the goods table exactly as it was, so it can be used without 
+// rehashing), then namesLength bytes of NUL terminated names, then 
+// numDeferred SnapshotDeferreds each followed by its arena
+typedef struct SnapshotHeader {
+    char magic[8];
+    unsigned long generation;
+    unsigned long allocatedGoods;
+    unsigned long numItems;
+    unsigned long namesLength;
+    unsigned long numDeferred;
+} SnapshotHeader;
+
+// A slot of the goods table in a snapshot. nameOffset is -1 for an empty
+// slot, otherwise where its name starts in the names
+typedef struct SnapshotGood {
+    long nameOffset;
+    unsigned int hash;
+    int quantity;
+    int id;
+} SnapshotGood;
+
+// A key with deferred messages in a snapshot
+typedef struct SnapshotDeferred {
+    int key;
+    int numMessages;
+    unsigned long arenaLength;
+} SnapshotDeferred;
+
+// Buffered output of a snapshot. It is written by a forked child, so 
+// it must not allocate
+typedef struct SnapshotWriter {
+    int fd;
+    size_t length;
+    bool failed;
+    char data[SNAPSHOT_BUFFER];
+} SnapshotWriter;
+
+// The write-ahead log. Records are appended to buffer by the event loop
+// and a writer thread swaps it with spare, writes it out and syncs it, so
+// everything logged while one sync is running is committed by the next
+// Logs are numbered by generation and a snapshot of generation g covers
+// every log up to and including g
+typedef struct Journal {
+    bool enabled;
+    char *directory;
+    char *prefix;
+    char *snapshotPath;
+    char *tempPath;
+    unsigned long generation;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t writer;
+    unsigned char *buffer;
+    unsigned char *spare;
+    size_t length;
+    size_t allocated;
+    size_t spareAllocated;
+    // the log being written and, while a new generation is started, the 
+    // next log, which gets everything in buffer after cutLength
+    int fd;
+    int nextFd;
+    size_t cutLength;
+    unsigned long sinceSnapshot;
+
+    // the child writing a snapshot, or 0, and the generation it covers
+    pid_t snapshotPid;
+    unsigned long snapshotGeneration;
+} Journal;
+
+// A Connect which hasn't heard an IM back yet. connection is NULL while
+// it waits to be retried, and deadline (in milliseconds) is when it times
+// out or is retried
+typedef struct PendingConnect {
+    int port;
+    int attempts;
+    long deadline;
+    Connection *connection;
+} PendingConnect;
+
+// Records in a capture of a depot's traffic. Each is a type byte, then a
+// varint connection number and a varint of microseconds since the record
+// before it, then its fields
+#define CAPTURE_OPEN 'O'    // byte 1 if we made the connection
+#define CAPTURE_READ 'R'    // varint length, bytes read from the socket
+#define CAPTURE_CLOSE 'C'
+#define CAPTURE_MAGIC "2310TRAC"
+// Size of the buffer a capture is written through
+#define CAPTURE_BUFFER (1024 * 1024)
+
+// A capture of everything read by the depot, written to file if 
+// DEPOT_CAPTURE names one, so it can be replayed with DEPOT_REPLAY. It is
+// written out at the end of every pass of an event loop which added to it
+typedef struct Capture {
+    FILE *file;
+    pthread_mutex_t lock;
+    long lastMicros;
+    unsigned int nextId;
+    bool dirty;
+} Capture;
+
+// A query this depot is taking part in, started by origin. It is passed
+// on to every neighbouring depot but parent, and answered to parent once 
+// they have all answered, or at deadline. It is kept for a while after 
+// that, so copies of it which arrive another way are recognised. entries
+// holds :depot:good:quantity for each good held by each depot heard from
+typedef struct Query {
+    char *origin;
+    int serial;
+    int parent;
+    int hops;
+    bool local;
+    bool done;
+    int waiting;
+    long deadline;
+    char *goods;
+    char *entries;
+    size_t entriesLength;
+    size_t entriesAllocated;
+} Query;
+
+// A depot's holding of a good, as reported in the answer to a query
+typedef struct Holding {
+    char *depot;
+    char *good;
+    int quantity;
+} Holding;
+
+// The answer to a recent query, in the lines sent back for it. key is the
+// hop limit and goods asked about, as in the Query message
+typedef struct CachedAnswer {
+    char *key;
+    char *reply;
+    long expires;
+} CachedAnswer;
+
+// Kinds of entry in a reactor's inbox
+#define INBOX_CONNECT 0   // make a Connect to port
+#define INBOX_GOODS 1     // send goods to the neighbour, name follows
+#define INBOX_TEXT 2      // send a line to the neighbour, which follows
+
+// Work handed to a reactor by another, for sockets only it may touch.
+// Entries are stored one after another in the inbox, each followed by
+// length bytes of name
+typedef struct InboxEntry {
+    int type;
+    int port;
+    int neighbour;
+    int quantity;
+    size_t length;
+} InboxEntry;
+
+// An event loop running on its own thread. Each has its own listening 
+// socket on the depot's port (the kernel shares out new connections 
+// between them) and owns every connection it accepts or makes
+typedef struct Reactor {
+    struct DepotContents *depotContents;
+    int index;
+    pthread_t thread;
+    int epollFd;
+    int serverFd;
+    // the Unix domain listening socket, shared by every reactor, or -1
+    int localFd;
+    // connections with output to send, connections held back by their 
+    // limits, and Connects in progress
+    Connection *dirtyConnections;
+    Connection *throttledConnections;
+    PendingConnect *pendingConnects;
+    int numPendingConnects;
+    size_t allocatedPendingConnects;
+    // work from other reactors, which wake this one through inboxFd
+    int inboxFd;
+    pthread_mutex_t inboxLock;
+    char *inbox;
+    size_t inboxLength;
+    size_t inboxAllocated;
+    Stats stats;
+} Reactor;
+
+// Length of a tick of the timer wheel in milliseconds. The wheel has 
+// WHEEL_LEVELS levels of WHEEL_SLOTS slots, each slot of a level covering
+// as long as the whole of the level below
+#define TIMER_TICK 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 6
+// Ticks ahead the wheel reaches. Timers due later wait at its far end
+#define WHEEL_SPAN (1L << (WHEEL_BITS * WHEEL_LEVELS))
+// Time in milliseconds a deferred key with no messages waiting can go 
+// without being deferred to, executed or scheduled before it is removed.
+// Waiting messages are kept until they are executed, unless 
+// DEPOT_DEFER_TTL gives a time after which they are dropped instead
+#define DEFER_TTL (60 * 60 * 1000)
+
+// Things a timer does when it is due
+#define TIMER_EXECUTE 0   // execute the key's messages
+#define TIMER_EXPIRE 1    // remove the key, if it has been idle long enough
+
+// Something to be done to a deferred key at a given tick
+typedef struct Timer {
+    struct Timer *next;
+    long due;
+    int type;
+    int key;
+} Timer;
+
+// A hierarchical timer wheel. A timer goes in the lowest level whose 
+// slots reach as far as it is due, and moves down a level each time the
+// level below goes round, so each tick only looks at one slot. now is the
+// next tick to be run. The first reactor runs the timers
+typedef struct TimerWheel {
+    pthread_mutex_t lock;
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    long now;
+    int numTimers;
+} TimerWheel;
+
 typedef struct DepotContents {
     char *name;
     int port;
 
-    char **type;
-    int *quantity;
+    Good *goods;
     int numItems;
     size_t allocatedGoods;
+    // the slot of each good by its id, with as many entries as the table
+    int *goodSlots;
+    NamePool names;
+    pthread_rwlock_t goodsLock;
 
     char **neighbours;
     int *neighbourPorts;
+    Connection **neighbourConnections;
     volatile int numNeighbours;
     size_t allocatedNeighbours;
-    bool *messageSent;
+    // open-addressing indexes from name and port to neighbour, -1 if empty
+    // neighbours sharing a name are chained through nextSameName
+    int *nameIndex;
+    int *portIndex;
+    int *nextSameName;
+    size_t allocatedIndex;
+    // routes to every depot heard of, found by name, which also come 
+    // under the neighbour lock
+    Route *routes;
+    int numRoutes;
+    size_t allocatedRoutes;
+    NamePool routeNames;
+    pthread_rwlock_t neighbourLock;
     
-    pthread_t *tid;
-    FILE **rstream;
-    FILE **wstream;
+    int signalFd;
+    Reactor *reactors;
+    int numReactors;
+    // other reactors stop while the first takes a snapshot
+    pthread_mutex_t pauseLock;
+    pthread_cond_t pauseChanged;
+    bool pauseRequested;
+    int numPaused;
+    Connection **connections;
     int numConnections;
     size_t allocatedConnections;
     sem_t lock;
+
+    long connectTimeout;
+    int connectAttempts;
+
+    // messages and bytes each connection may send a second (0 if there is
+    // no limit), which it can save up a second of, the most bytes of
+    // deferred messages kept (0 if there is no limit) and the longest line
+    // a connection may send
+    long peerMessages;
+    long peerBytes;
+    size_t deferLimit;
+    size_t messageLimit;
+
+    // queries in progress or recently answered, and the answers cached
+    pthread_mutex_t queryLock;
+    Query *queries;
+    int numQueries;
+    size_t allocatedQueries;
+    int nextSerial;
+    CachedAnswer answers[QUERY_CACHE_SIZE];
+    long queryTimeout;
+    long queryTtl;
+
+    Capture capture;
+
+    // neighbours mirroring our goods, which come under the neighbour lock,
+    // the ids of goods changed since mirrors were last sent them, the 
+    // serial of the last thing sent to mirrors and when changes are next
+    // sent
+    int *mirrors;
+    int numMirrors;
+    size_t allocatedMirrors;
+    pthread_mutex_t mirrorLock;
+    int *changedGoods;
+    int numChanged;
+    size_t allocatedChanged;
+    unsigned long mirrorSerial;
+    long mirrorInterval;
+    long nextMirrorFlush;
+    // the depot whose goods we mirror, or NULL, which comes under the 
+    // neighbour lock, and the serial of the last resync it sent
+    char *followName;
+    unsigned long followSerial;
     
     DeferredMessage *deferredMessages;
     int numDeferredMessages;
     size_t allocatedDeferredMessages;
+    size_t deferredBytes;
+    // how long a key's waiting messages are kept unused, or 0 for ever
+    long deferTtl;
+
+    // scheduled Executes and key expiries
+    TimerWheel timers;
 
+    Journal journal;
 } DepotContents;
 
 void init_lock(sem_t *);
 void take_lock(sem_t *);
 void release_lock(sem_t *);
+long nanos_since(struct timespec *);
+void record_lock_wait(struct timespec *);
+void record_message(MessageType, struct timespec *);
+void sum_stats(DepotContents *, Stats *);
+char *format_stats(DepotContents *);
+void send_stats(DepotContents *, Connection *);
+void take_read_lock(pthread_rwlock_t *);
+void take_write_lock(pthread_rwlock_t *);
+void release_rw_lock(pthread_rwlock_t *);
 void show_message(int);
+void handle_signals(DepotContents *);
 void check_args(int, char *[]);
 bool char_in_sequence(char *, char); 
 int check_valid_number(char *, int);
 bool valid_name(char *);
-void print_list(DepotContents *, int, char **, int);
+int compare_entries(const void *, const void *);
+void print_list(ListEntry *, int, bool);
+void print_goods(DepotContents *);
+void print_neighbours(DepotContents *);
 void setup_depot(DepotContents *, int, char *[]);
-int goods_at_depot(DepotContents *, char *);
+unsigned int hash_name(const char *);
+int good_at_depot(DepotContents *, char *, unsigned int);
+void grow_goods(DepotContents *);
+char *intern_name(NamePool *, char *);
+int insert_good(DepotContents *, char *, unsigned int, int);
+int intern_good(DepotContents *, char *);
 void add_goods(DepotContents *, char *, int);
+void add_goods_by_id(DepotContents *, int, int);
+void add_goods_batch(DepotContents *, BatchItem *, int);
 void run_server(DepotContents *);
-void *handle_connection(void *);
-int get_tid(DepotContents *);
-void *handle_server_thread(void *);
-void read_from_stream(DepotContents *, FILE *, bool);
-void interpret_message(DepotContents *, char *, bool);
+int open_listener(int);
+socklen_t local_address(struct sockaddr_un *, int);
+int open_local_listener(int);
+int connect_local(int);
+void *reactor_thread(void *);
+void run_reactor(DepotContents *, Reactor *);
+void post_to_reactor(Reactor *, InboxEntry *, const char *);
+void drain_inbox(DepotContents *, Reactor *);
+void pause_reactors(DepotContents *, Reactor *);
+void resume_reactors(DepotContents *);
+void wait_while_paused(DepotContents *);
+void set_nonblocking(int);
+void accept_connections(DepotContents *, Reactor *, int);
+Connection *add_connection(DepotContents *, Reactor *, int, bool);
+void close_connection(DepotContents *, Connection *);
+void handle_event(DepotContents *, Connection *, uint32_t);
+void handle_output(DepotContents *, Connection *);
+char *scratch_buffer(Connection *, size_t);
+void send_message(Connection *, const char *, ...);
+void queue_output(Connection *, const void *, size_t);
+void mark_dirty(Connection *);
+void flush_dirty(Reactor *);
+void rearm_connection(Connection *);
+void flush_connection(Connection *);
+size_t put_varint(unsigned char *, unsigned int);
+int get_varint(unsigned char **, unsigned char *, unsigned int *);
+void send_frame(Connection *, unsigned char, const unsigned char *, size_t);
+int good_id(DepotContents *, char *);
+void send_goods(DepotContents *, Connection *, int, int, char *);
+void negotiate_protocol(Connection *, char *);
+char *read_line(DepotContents *, Connection *, char *, char *, char *);
+char *read_frame(DepotContents *, Connection *, char *, char *);
+void interpret_frame(DepotContents *, Connection *, unsigned char, 
+        unsigned char *, unsigned char *);
+bool read_from_stream(DepotContents *, Connection *);
+bool process_input(DepotContents *, Connection *);
+bool admit_message(DepotContents *, Connection *);
+void refill_tokens(DepotContents *, Connection *);
+void throttle_connection(Connection *);
+void check_throttled(DepotContents *, Reactor *);
+int throttle_wait(Reactor *);
+void interpret_message(DepotContents *, Connection *, char *, bool);
+MessageType dispatch_message(DepotContents *, Connection *, char *, bool);
 void move_items(DepotContents *, char *, int);
-void defer_message(DepotContents *, char *);
-void execute_message(DepotContents *, char *);
-void add_neighbour(DepotContents *, char *);
+void batch_items(DepotContents *, Connection *, char *);
+unsigned int hash_key(int);
+DeferredMessage *find_key(DepotContents *, int, bool);
+void grow_deferred(DepotContents *);
+bool store_deferred(DepotContents *, int, char *, size_t, size_t);
+void compile_deferred(DepotContents *, DeferredMessage *, size_t);
+void compile_move(DepotContents *, DeferredMessage *, char *, size_t, 
+        int);
+bool compile_items(DepotContents *, DeferredMessage *, char *, size_t, 
+        int);
+DeferredOp *add_deferred_op(DeferredMessage *, int);
+bool take_deferred(DepotContents *, int, DeferredMessage *);
+void apply_deferred(DepotContents *, Reactor *, DeferredMessage *);
+Good *deferred_good(DepotContents *, DeferredOp *);
+DeferredSend *add_deferred_send(DeferredSend **, int *, size_t *);
+int compare_sends(const void *, const void *);
+void send_deferred(DepotContents *, Reactor *, DeferredSend *, int);
+bool open_journal(DepotContents *);
+char *log_path(Journal *, unsigned long);
+int open_log(Journal *, unsigned long);
+void *journal_writer(void *);
+void write_fully(int, const void *, size_t);
+unsigned char *reserve_journal(Journal *, size_t);
+void commit_journal(Journal *, size_t);
+size_t put_goods_record(unsigned char *, char *, int);
+void log_goods(DepotContents *, char *, int);
+void log_defer(DepotContents *, int, char *, size_t);
+void log_execute(DepotContents *, int);
+unsigned long load_snapshot(DepotContents *);
+void corrupt_state(const char *);
+bool replay_log(DepotContents *, unsigned long);
+void check_snapshot(DepotContents *, Reactor *);
+void take_snapshot(DepotContents *, Reactor *);
+void snapshot_write(SnapshotWriter *, const void *, size_t);
+void flush_snapshot(SnapshotWriter *);
+void write_snapshot(DepotContents *, unsigned long);
+void reap_snapshot(DepotContents *);
+void defer_message(DepotContents *, Connection *, char *);
+void execute_message(DepotContents *, Connection *, char *);
+void execute_key(DepotContents *, Connection *, int);
+Reactor *message_reactor(DepotContents *, Connection *);
+void schedule_execute(DepotContents *, char *, bool);
+long read_millis(char *);
+long wall_millis(void);
+void touch_key(DepotContents *, DeferredMessage *);
+void remove_key(DepotContents *, DeferredMessage *);
+long key_ttl(DepotContents *);
+void expire_key(DepotContents *, int);
+void add_timer(DepotContents *, int, int, long);
+bool place_timer(TimerWheel *, Timer *);
+void run_timers(DepotContents *);
+int timer_wait(DepotContents *);
+int find_neighbour(DepotContents *, char *);
+int find_port(DepotContents *, int);
+void index_neighbour(DepotContents *, int);
+void grow_neighbour_index(DepotContents *);
+void add_neighbour(DepotContents *, Connection *, char *);
+void depot_offered(DepotContents *, Connection *);
+void greet_depot(DepotContents *, Connection *);
+void add_new_neighbour(DepotContents *, Connection *, int, char *);
+int find_route(DepotContents *, char *, unsigned int);
+void grow_routes(DepotContents *);
+Route *add_route(DepotContents *, char *, unsigned int);
+void learn_route(DepotContents *, Reactor *, int, char *, int);
+void advertise_route(DepotContents *, Reactor *, Route *);
+void send_route(DepotContents *, Reactor *, int, int, char *);
+void send_routes(DepotContents *, Connection *);
+void lose_routes(DepotContents *, Reactor *, int);
+void route_message(DepotContents *, Connection *, char *);
+void send_to_neighbour(DepotContents *, Reactor *, int, char *);
+void send_goods_to_neighbour(DepotContents *, Reactor *, int, int, char *);
 void connect_depots(DepotContents *, char *);
-void transfer(DepotContents *, char *);
+long current_millis(void);
+int config_value(const char *, int);
+void connect_to_port(DepotContents *, Reactor *, int);
+int find_pending(Reactor *, int);
+PendingConnect *add_pending(Reactor *, int);
+void start_connect(DepotContents *, Reactor *, PendingConnect *);
+void finish_connect(Connection *);
+void retry_connect(DepotContents *, Reactor *, int);
+void check_connects(DepotContents *, Reactor *);
+int connect_wait(Reactor *);
+void transfer(DepotContents *, Connection *, char *);
+void forward_goods(DepotContents *, Connection *, char *);
+void start_query(DepotContents *, Connection *, char *);
+void probe_query(DepotContents *, Connection *, char *);
+void answer_query(DepotContents *, Connection *, char *);
+Query *add_query(DepotContents *, char *, int, int, int, char *);
+bool valid_goods(char *);
+Query *find_query(DepotContents *, char *, int);
+void add_holdings(DepotContents *, Query *);
+void append_entries(Query *, const char *);
+int pass_on_query(DepotContents *, Reactor *, Query *, int);
+void finish_query(DepotContents *, Reactor *, Query *);
+char *format_answer(Query *);
+int compare_holdings(const void *, const void *);
+char *query_key(int, char *);
+void cache_answer(DepotContents *, char *, char *);
+char *cached_answer(DepotContents *, char *);
+void check_queries(DepotContents *, Reactor *);
+int query_wait(DepotContents *);
+void note_change(DepotContents *, Good *);
+void follow_depot(DepotContents *, Connection *, char *);
+void add_mirror(DepotContents *, Connection *);
+void remove_mirror(DepotContents *, int);
+char *format_mirror(DepotContents *, const char *, unsigned long, int *, 
+        int);
+void flush_mirrors(DepotContents *, Reactor *);
+int mirror_wait(DepotContents *);
+void mirror_goods(DepotContents *, Connection *, char *, bool);
+bool followed(DepotContents *, Connection *);
+long current_micros(void);
+void open_capture(DepotContents *);
+void capture_event(DepotContents *, int, Connection *, const char *, 
+        size_t);
+void flush_capture(DepotContents *);
+void replay_trace(DepotContents *, char *);
+void replay_read(DepotContents *, Reactor *, Connection *, 
+        const unsigned char *, size_t);